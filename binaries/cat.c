@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <mman.h>
 
 int main(int argc, char** argv) {
     if (argc != 2) {
@@ -19,10 +20,15 @@ int main(int argc, char** argv) {
     }
 
     uint64_t file_size = get_file_size(argv[1]);
-    uint8_t buffer[file_size];
+    if (file_size == 0) return 0;
     int file_fd = open_file(argv[1], 0);
-    read(file_fd, buffer, file_size);
-    write(STDOUT_FILENO, buffer, file_size);
+    uint8_t* buffer = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
     close(file_fd);
+    if (buffer == MAP_FAILED) {
+        printf("%s: cannot map file\n", argv[1]);
+        return 1;
+    }
+    write(STDOUT_FILENO, buffer, file_size);
+    munmap(buffer, file_size);
     return 0;
 }
@@ -1,6 +1,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <mman.h>
 
 int main(int argc, char** argv) {
     if (argc != 3) {
@@ -24,17 +25,20 @@ int main(int argc, char** argv) {
     }
 
     size_t file_size = get_file_size(argv[1]);
-    unsigned char buffer[file_size];
+    unsigned char* buffer = NULL;
     int file_fd = open_file(argv[1], 0);
-    int ret = read(file_fd, buffer, file_size);
-    if (ret < 0) {
-        printf("Read error: %d\n", ret);
-        return 1;
+    if (file_size) {
+        buffer = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+        if (buffer == MAP_FAILED) {
+            printf("Read error: cannot map %s\n", argv[1]);
+            return 1;
+        }
     }
     close(file_fd);
     file_fd = open_file(argv[2], FLAG_CREATE);
-    ret = write(file_fd, buffer, file_size);
+    int ret = write(file_fd, buffer, file_size);
     close(file_fd);
+    if (buffer) munmap(buffer, file_size);
     if (ret < 0) {
         printf("Write error: %d\n", ret);
         return 1;
@@ -0,0 +1,33 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sched.h>
+
+// Busy and idle time of each CPU since boot, or over an interval with an argument in ms
+#define MAX_CPUS 64
+
+static int snapshot(cpu_stats_t* stats) {
+    int cpus = 0;
+    while (cpus < MAX_CPUS && get_cpu_stats(cpus, &stats[cpus]) == 0) cpus++;
+    return cpus;
+}
+
+int main(int argc, char** argv) {
+    cpu_stats_t before[MAX_CPUS] = {0};
+    cpu_stats_t after[MAX_CPUS];
+    if (argc > 1) {
+        snapshot(before);
+        sleep(atoi(argv[1]));
+    }
+    int cpus = snapshot(after);
+    for (int cpu = 0; cpu < cpus; cpu++) {
+        uint64_t busy = (after[cpu].busy_ns - before[cpu].busy_ns) / 1000000;
+        uint64_t idle = (after[cpu].idle_ns - before[cpu].idle_ns) / 1000000;
+        uint64_t total = busy + idle;
+        printf("cpu %d: %u%% idle, %u ms busy, %u ms idle, %u halts, %u switches, %u steals\n", (int64_t)cpu,
+               total ? idle * 100 / total : 0, busy, idle, after[cpu].halts - before[cpu].halts,
+               after[cpu].switches - before[cpu].switches, after[cpu].steals - before[cpu].steals);
+    }
+    return 0;
+}
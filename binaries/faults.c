@@ -0,0 +1,26 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <mman.h>
+
+// Print the system-wide page fault counters
+int main() {
+    fault_stats_t stats;
+    if (get_fault_stats(FAULT_STATS_SYSTEM, &stats) != 0) {
+        printf("Cannot read fault statistics\n");
+        return 1;
+    }
+    printf("minor:      %u\n", stats.minor);
+    printf("major:      %u\n", stats.major);
+    printf("zero-fill:  %u\n", stats.zero_fills);
+    printf("zero page:  %u\n", stats.zero_page_maps);
+    printf("file:       %u\n", stats.file_pages);
+    printf("cow copy:   %u\n", stats.cow_copies);
+    printf("cow reuse:  %u\n", stats.cow_reuses);
+    printf("guard page: %u\n", stats.guard_hits);
+    printf("invalid:    %u\n", stats.invalid);
+    printf("\nCache         hits    misses\n");
+    printf("zero pool:    %u %u\n", stats.zero_pool_hits, stats.zero_pool_misses);
+    printf("file cache:   %u %u\n", stats.file_cache_hits, stats.file_cache_misses);
+    printf("kernel stack: %u %u\n", stats.kernel_stack_hits, stats.kernel_stack_misses);
+    return 0;
+}
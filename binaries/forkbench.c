@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <mman.h>
+
+// Fork latency as a function of how much memory the parent has mapped
+#define FORKS 200
+
+static void run(size_t size) {
+    uint8_t* memory = NULL;
+    if (size) {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            printf("%u KiB: cannot map memory\n", (uint64_t)(size / 1024));
+            return;
+        }
+        for (size_t i = 0; i < size; i += 4096) memory[i] = 1; // Fault every page in
+    }
+
+    uint64_t start = get_uptime();
+    for (int i = 0; i < FORKS; i++) {
+        pid_t pid = fork();
+        if (pid == 0) exit(0);
+        waitpid(pid, NULL, 0);
+    }
+    uint64_t elapsed = get_uptime() - start;
+    printf("%u KiB mapped: %u us per fork+exit+wait\n", (uint64_t)(size / 1024), elapsed * 1000 / FORKS);
+
+    if (memory) munmap(memory, size);
+}
+
+int main() {
+    for (size_t size = 0; size <= 64 * 1024 * 1024; size = size ? size * 4 : 64 * 1024) {
+        run(size);
+    }
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include <sched.h>
+
+// Ping-pong between two tasks that both keep all sixteen XMM registers live across every
+// switch, against the same ping-pong with no FPU use, so each switch pays for the #NM trap
+// and a full save and restore. Also checks the registers come back unchanged. Both tasks are
+// pinned to CPU 0, on separate CPUs yield() would find nothing else to switch to.
+#define ROUNDS 20000
+#define VECTOR_LENGTH 512
+
+static double vector[VECTOR_LENGTH];
+
+// Yield with xmm0-xmm15 loaded from in, and stored to out once the task runs again. Done in
+// one asm block so the compiler can't touch the registers in between.
+static void yield_with_xmm(const uint64_t* in, uint64_t* out) {
+    asm volatile(
+        "movdqu 0x00(%1), %%xmm0\n"
+        "movdqu 0x10(%1), %%xmm1\n"
+        "movdqu 0x20(%1), %%xmm2\n"
+        "movdqu 0x30(%1), %%xmm3\n"
+        "movdqu 0x40(%1), %%xmm4\n"
+        "movdqu 0x50(%1), %%xmm5\n"
+        "movdqu 0x60(%1), %%xmm6\n"
+        "movdqu 0x70(%1), %%xmm7\n"
+        "movdqu 0x80(%1), %%xmm8\n"
+        "movdqu 0x90(%1), %%xmm9\n"
+        "movdqu 0xa0(%1), %%xmm10\n"
+        "movdqu 0xb0(%1), %%xmm11\n"
+        "movdqu 0xc0(%1), %%xmm12\n"
+        "movdqu 0xd0(%1), %%xmm13\n"
+        "movdqu 0xe0(%1), %%xmm14\n"
+        "movdqu 0xf0(%1), %%xmm15\n"
+        "int $0x80\n"
+        "movdqu %%xmm0, 0x00(%2)\n"
+        "movdqu %%xmm1, 0x10(%2)\n"
+        "movdqu %%xmm2, 0x20(%2)\n"
+        "movdqu %%xmm3, 0x30(%2)\n"
+        "movdqu %%xmm4, 0x40(%2)\n"
+        "movdqu %%xmm5, 0x50(%2)\n"
+        "movdqu %%xmm6, 0x60(%2)\n"
+        "movdqu %%xmm7, 0x70(%2)\n"
+        "movdqu %%xmm8, 0x80(%2)\n"
+        "movdqu %%xmm9, 0x90(%2)\n"
+        "movdqu %%xmm10, 0xa0(%2)\n"
+        "movdqu %%xmm11, 0xb0(%2)\n"
+        "movdqu %%xmm12, 0xc0(%2)\n"
+        "movdqu %%xmm13, 0xd0(%2)\n"
+        "movdqu %%xmm14, 0xe0(%2)\n"
+        "movdqu %%xmm15, 0xf0(%2)\n"
+        :
+        : "a"((uint64_t)SYSCALL_YIELD), "r"(in), "r"(out)
+        : "rcx", "r11", "memory", "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",
+          "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15");
+}
+
+// Returns the number of rounds whose registers came back changed
+static int work(int fpu, uint64_t seed) {
+    uint64_t in[32];
+    uint64_t out[32];
+    int corrupted = 0;
+    for (int i = 0; i < VECTOR_LENGTH; i++) vector[i] = (double)(seed + i);
+    for (int round = 0; round < ROUNDS; round++) {
+        if (!fpu) {
+            yield();
+            continue;
+        }
+        for (int i = 0; i < VECTOR_LENGTH; i++) vector[i] = vector[i] * 0.999 + 1.0;
+        for (int i = 0; i < 32; i++) in[i] = seed * 0x9e3779b97f4a7c15ull + round * 32 + i;
+        yield_with_xmm(in, out);
+        for (int i = 0; i < 32; i++) {
+            if (in[i] != out[i]) {
+                corrupted++;
+                break;
+            }
+        }
+    }
+    return corrupted;
+}
+
+static void run(const char* name, int fpu) {
+    uint64_t start = get_uptime_ns();
+    pid_t pid = fork();
+    if (pid == 0) exit(work(fpu, 2));
+    int corrupted = work(fpu, 1);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    uint64_t elapsed = get_uptime_ns() - start;
+    printf("%s: %u ns per round trip", name, elapsed / ROUNDS);
+    if (corrupted || status) printf(", registers changed in %u rounds", (uint64_t)(corrupted + status));
+    printf("\n");
+}
+
+int main() {
+    int64_t affinity = get_affinity(0);
+    set_affinity(0, 1); // Inherited by the child
+    run("integer only", 0);
+    run("both tasks using all XMM registers", 1);
+    set_affinity(0, affinity);
+    return 0;
+}
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <cpu.h>
+
+// Throughput of each mem* variant for a range of block sizes
+#define TOTAL_BYTES (64 * 1024 * 1024)
+#define MAX_BLOCK (64 * 1024)
+
+typedef struct {
+    const char* name;
+    int (*memcmp)(const void*, const void*, size_t);
+    void* (*memcpy)(void*, const void*, size_t);
+    void* (*memset)(void*, unsigned char, size_t);
+    void* (*memmove)(void*, const void*, size_t);
+} variant_t;
+
+static variant_t variants[] = {
+    {"scalar", memcmp_scalar, memcpy_scalar, memset_scalar, memmove_scalar},
+    {"sse2", memcmp_sse2, memcpy_sse2, memset_sse2, memmove_sse2},
+    {"avx2", memcmp_avx2, memcpy_avx2, memset_avx2, memmove_avx2},
+};
+
+static uint8_t source[MAX_BLOCK + 64];
+static uint8_t dest[MAX_BLOCK + 64];
+
+// MiB/s, or 0 when the run was too short to measure
+static uint64_t rate(uint64_t start) {
+    uint64_t elapsed = get_uptime() - start;
+    return elapsed ? (uint64_t)TOTAL_BYTES * 1000 / elapsed / (1024 * 1024) : 0;
+}
+
+static void run(variant_t* variant, size_t size) {
+    size_t rounds = TOTAL_BYTES / size;
+    int sink = 0;
+
+    uint64_t start = get_uptime();
+    for (size_t i = 0; i < rounds; i++) variant->memcpy(dest, source, size);
+    uint64_t copy = rate(start);
+
+    start = get_uptime();
+    for (size_t i = 0; i < rounds; i++) variant->memset(dest, (unsigned char)i, size);
+    uint64_t set = rate(start);
+
+    variant->memcpy(dest, source, size);
+    start = get_uptime();
+    for (size_t i = 0; i < rounds; i++) sink += variant->memcmp(dest, source, size);
+    uint64_t compare = rate(start);
+
+    start = get_uptime();
+    for (size_t i = 0; i < rounds; i++) variant->memmove(dest + 8, dest, size); // Overlapping, copied top down
+    uint64_t move = rate(start);
+
+    printf("%s %u B: memcpy %u  memset %u  memcmp %u  memmove %u MiB/s%s\n", variant->name, (uint64_t)size,
+           copy, set, compare, move, sink ? " (mismatch)" : "");
+}
+
+int main() {
+    for (size_t i = 0; i < sizeof(source); i++) source[i] = (uint8_t)(i * 7);
+
+    int count = cpu_supports_avx2() ? 3 : 2;
+    for (size_t size = 64; size <= MAX_BLOCK; size *= 4) {
+        for (int v = 0; v < count; v++) run(&variants[v], size);
+    }
+    return 0;
+}
@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+
+// nice [-n adjustment] [command [args...]], with no command print the current nice value
+int main(int argc, char** argv) {
+    int adjustment = 10;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        adjustment = atoi(argv[2]);
+        first = 3;
+    }
+    if (first >= argc) {
+        printf("%d\n", (int64_t)getpriority(0));
+        return 0;
+    }
+
+    setpriority(0, getpriority(0) + adjustment);
+    char* path = argv[first];
+    char program_in_bin[strlen("/bin/") + strlen(path) + 1];
+    if (strchr(path, '/') == NULL) {
+        strcpy(program_in_bin, "/bin/");
+        strcat(program_in_bin, path);
+        path = program_in_bin;
+    }
+    execv(path, (const char**)&argv[first]);
+    printf("Cannot run %s\n", argv[first]);
+    return 1;
+}
@@ -0,0 +1,28 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+
+// How long usleep() really takes, against the requested time
+#define SLEEPS 100
+
+static void run(uint64_t us) {
+    int64_t total = 0;
+    int64_t worst = 0;
+    for (int i = 0; i < SLEEPS; i++) {
+        uint64_t start = get_uptime_ns();
+        usleep(us);
+        int64_t late = (int64_t)(get_uptime_ns() - start) - (int64_t)(us * 1000); // Negative if it woke early
+        total += late;
+        if (late > worst) worst = late;
+    }
+    printf("%u us: %d ns late on average, %d ns at worst\n", us, total / SLEEPS, worst);
+}
+
+int main() {
+    uint64_t durations[] = {20, 100, 500, 1000, 10000};
+    for (size_t i = 0; i < sizeof(durations) / sizeof(durations[0]); i++) {
+        run(durations[i]);
+    }
+    return 0;
+}
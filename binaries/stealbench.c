@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+// Wall time of N CPU-bound children started with spawn(), and how busy each CPU was, once
+// with the children free to spread over the CPUs and once with all of them pinned to CPU 0
+#define DEFAULT_CHILDREN 8
+#define MAX_CHILDREN 64
+#define ITERATIONS 200000000
+
+static void spin() {
+    volatile uint64_t counter = 0;
+    for (uint64_t i = 0; i < ITERATIONS; i++) counter++;
+}
+
+static int snapshot(cpu_stats_t* stats) {
+    int cpus = 0;
+    while (cpus < 64 && get_cpu_stats(cpus, &stats[cpus]) == 0) cpus++;
+    return cpus;
+}
+
+static void run(const char* name, int children, uint64_t affinity) {
+    cpu_stats_t before[64], after[64];
+    pid_t pids[MAX_CHILDREN];
+    set_affinity(0, affinity); // Inherited by the children
+    int cpus = snapshot(before);
+    uint64_t start = get_uptime();
+    for (int i = 0; i < children; i++) {
+        pids[i] = spawn("/bin/stealbench", (const char*[]){"/bin/stealbench", "spin", NULL});
+    }
+    for (int i = 0; i < children; i++) {
+        if (pids[i] > 0) waitpid(pids[i], NULL, 0);
+    }
+    uint64_t elapsed = get_uptime() - start;
+    snapshot(after);
+    set_affinity(0, UINT64_MAX);
+
+    printf("%s: %d children in %u ms\n", name, (int64_t)children, elapsed);
+    for (int cpu = 0; cpu < cpus; cpu++) {
+        uint64_t busy = after[cpu].busy_ns - before[cpu].busy_ns;
+        uint64_t total = busy + after[cpu].idle_ns - before[cpu].idle_ns;
+        printf("  cpu %d: %u%% busy, %u switches, %u steals\n", (int64_t)cpu, total ? busy * 100 / total : 0,
+               after[cpu].switches - before[cpu].switches, after[cpu].steals - before[cpu].steals);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "spin") == 0) {
+        spin();
+        return 0;
+    }
+    int children = argc > 1 ? atoi(argv[1]) : DEFAULT_CHILDREN;
+    if (children <= 0 || children > MAX_CHILDREN) children = DEFAULT_CHILDREN;
+    run("spread", children, UINT64_MAX);
+    run("pinned to cpu 0", children, 1);
+    return 0;
+}
@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sched.h>
+
+// Cost of a task switch, with two tasks yielding to each other, when neither, one or
+// both of them keep using the FPU between switches. Both run on CPU 0, otherwise they would
+// each get a CPU of their own and yield() would not switch at all.
+#define YIELDS 20000
+
+static volatile double sum;
+
+static void work(int fpu) {
+    for (int i = 0; i < YIELDS; i++) {
+        if (fpu) sum = sum * 0.5 + i;
+        yield();
+    }
+}
+
+static void run(const char* name, int parent_fpu, int child_fpu) {
+    uint64_t start = get_uptime();
+    pid_t pid = fork();
+    if (pid == 0) {
+        work(child_fpu);
+        exit(0);
+    }
+    work(parent_fpu);
+    waitpid(pid, NULL, 0);
+    uint64_t elapsed = get_uptime() - start;
+    printf("%s: %u ns per switch\n", name, elapsed * 1000000 / (2 * YIELDS));
+}
+
+int main() {
+    int64_t affinity = get_affinity(0);
+    set_affinity(0, 1); // Inherited by the child
+    run("integer only", 0, 0);
+    run("one task using the FPU", 1, 0);
+    run("both tasks using the FPU", 1, 1);
+    set_affinity(0, affinity);
+    return 0;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <stdint.h>
+
+#define MAX_CPUS 16
+
+#define MSR_APIC_BASE 0x1B
+#define MSR_GS_BASE 0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102
+#define MSR_TSC_DEADLINE 0x6E0
+
+struct Task;
+
+// State of one CPU, reached through the GS base while in the kernel. User mode runs with
+// its own GS base, swapped in and out by swapgs on every kernel entry and exit.
+typedef struct Cpu {
+    struct Cpu* self; // Read as %gs:0
+    int id;           // Read as %gs:8, index into cpus[]
+    uint32_t lapic_id;
+    struct Task* task; // Running task, NULL while idle
+    volatile int need_resched; // Switch tasks on the way back to user mode
+    int lock_depth; // Nesting of the big kernel lock on this CPU
+    volatile int online;
+    volatile int idle; // Halted with nothing to run, woken by an IPI
+    void* idle_stack;
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+extern int cpu_count;
+
+static inline cpu_t* this_cpu() {
+    cpu_t* cpu;
+    asm volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+static inline int cpu_id() {
+    int id;
+    asm volatile("movl %%gs:8, %0" : "=r"(id));
+    return id;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" :: "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)) : "memory");
+}
+
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline uint64_t irq_save() {
+    uint64_t flags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    if (flags & 0x200) asm volatile("sti" ::: "memory");
+}
+
+typedef struct {
+    volatile int locked;
+} spinlock_t;
+
+static inline void spin_lock(spinlock_t* lock) {
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        while (lock->locked) asm volatile("pause");
+    }
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
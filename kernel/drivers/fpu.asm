@@ -1,9 +1,11 @@
 section .data
 align 16
 global has_xsave
+global has_xsaveopt
 global fpu_memory_size
 fpu_cw dw 0x037F       ; Default FPU control word
 has_xsave db 0
+has_xsaveopt db 0
 fpu_memory_size dd 0
 
 section .text
@@ -83,35 +85,37 @@ no_avx:
     mov eax, 0xD
     cpuid               ; EBX = XSAVE memory size
     mov [fpu_memory_size], ebx
+    mov eax, 0xD
+    mov ecx, 1          ; sub-leaf 1
+    cpuid               ; EAX bit 0 = XSAVEOPT
+    and al, 1
+    mov [has_xsaveopt], al
     ret
 mem_512:
     mov dword [fpu_memory_size], 512
     ret
 
 save_fpu:
-    xor rax, rax
-    mov al, [has_xsave]
-    test al, al
-    jz use_fxsave
-
-    xor ecx, ecx        ; sub-leaf 0
-    mov eax, 0xD
-    cpuid               ; EAX = supported low 32, EDX = supported high 32
+    mov eax, -1         ; Every component enabled in XCR0
+    mov edx, -1
+    cmp byte [has_xsaveopt], 0
+    jne use_xsaveopt
+    cmp byte [has_xsave], 0
+    je use_fxsave
     xsave [rdi]
     ret
+use_xsaveopt:
+    xsaveopt [rdi]      ; Skips components still in their init state or unchanged since the xrstor
+    ret
 use_fxsave:
     fxsave [rdi]
     ret
 
 restore_fpu:
-    xor rax, rax
-    mov al, [has_xsave]
-    test al, al
-    jz use_fxrstor
-
-    xor ecx, ecx        ; sub-leaf 0
-    mov eax, 0xD
-    cpuid               ; EAX = supported low 32, EDX = supported high 32
+    mov eax, -1         ; Every component enabled in XCR0
+    mov edx, -1
+    cmp byte [has_xsave], 0
+    je use_fxrstor
     xrstor [rdi]
     ret
 use_fxrstor:
@@ -2,8 +2,29 @@
 #include <stdint.h>
 
 extern uint8_t has_xsave;
+extern uint8_t has_xsaveopt;
 extern uint32_t fpu_memory_size;
 
 void init_fpu();
 void save_fpu(void* memory);
 void restore_fpu(void* memory);
+
+#define CR0_TS (1 << 3)
+
+// While CR0.TS is set the next x87, SSE or AVX instruction raises #NM
+static inline void fpu_enable() {
+    asm volatile("clts" ::: "memory");
+}
+
+static inline void fpu_disable() {
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_TS) : "memory");
+}
+
+// Turn a zeroed save area into the power-on state: default x87 control word and all SIMD
+// exceptions masked. Components left out of the XSAVE header start in their init state.
+static inline void init_fpu_state(void* memory) {
+    *(uint16_t*)memory = 0x037F;
+    *(uint32_t*)((uint8_t*)memory + 24) = 0x1F80;
+}
@@ -1,5 +1,6 @@
 #include "net.h"
 #include "../net/dhcp.h"
+#include "../string.h"
 #include <stddef.h>
 
 net_if_t net_interfaces[10];
@@ -7,23 +8,6 @@ int net_interface_count = 0;
 net_driver_t net_drivers[10];
 int net_driver_count = 0;
 
-static int strcmp(const char *s1, const char *s2) {
-    while (*s1 && *s2 && (*s1 == *s2)) {
-        s1++;
-        s2++;
-    }
-    return *(unsigned char *)s1 - *(unsigned char *)s2;
-}
-
-static int strncpy(char *dest, const char *src, size_t n) {
-    size_t i;
-    for (i = 0; i < n - 1 && src[i] != '\0'; i++) {
-        dest[i] = src[i];
-    }
-    dest[i] = '\0'; // Null-terminate the destination string
-    return i;
-}
-
 int get_if_index_by_name(const char* name) {
     for (int i = 0; i < net_interface_count; i++) {
         if (strcmp(net_interfaces[i].name, name) == 0) {
@@ -32,9 +32,10 @@ void rtl8139_init(pci_device_t device) {
     uint32_t command = pci_config_read(device.bus, device.device, device.function, 0x04);
     command |= 0x07; // Set the bus mastering bit
     pci_config_write(device.bus, device.device, device.function, 0x04, command);
-    rx_buffers[cards_existing] = kmalloc(8192 + 16); // Allocate buffer for receiving packets
+    // DMA buffers must be physically contiguous and below 4 GiB
+    rx_buffers[cards_existing] = kmalloc_contiguous(8192 + 16, 0x100000000); // Allocate buffer for receiving packets
     for (int i = 0; i < 512; i++) received_packets[cards_existing][i] = kmalloc(2048);
-    for (int i = 0; i < 4; i++) transmitter_buffers[cards_existing][i] = kmalloc(2048);
+    for (int i = 0; i < 4; i++) transmitter_buffers[cards_existing][i] = kmalloc_contiguous(2048, 0x100000000);
     turn_on_rtl8139(cards_existing);
     cards_existing++;
     register_net_interface(driver_index, cards_existing - 1);
@@ -1,37 +1,184 @@
 #include "../io/ports.h"
+#include "../io/lapic.h"
+#include "../io/8259pic.h"
+#include "../cpu.h"
+#include "../usermode/scheduler.h"
 #include "timer.h"
 #include <stdint.h>
 
-#define PIT_FREQUENCY 1000
+#define PIT_HZ 1193182
+#define CALIBRATION_MS 10
 
-uint64_t pit_ticks = 0;
+#define CPUID_TSC_DEADLINE (1 << 24) // ECX of leaf 1
 
-void pit_tick() {
-    pit_ticks++;
-}
+// The clock counts nanoseconds since boot on the TSC, which is calibrated against the PIT
+// and runs in step on all CPUs. There is no periodic tick: each CPU keeps a heap of its armed
+// timers plus the end of the running task's slice, and programs its timer hardware in one-shot
+// mode for the earliest of them. A CPU with nothing to run and nothing armed is left alone
+// until an interrupt or IPI wakes it.
+typedef enum {
+    TIMER_NONE,
+    TIMER_TSC_DEADLINE, // Local APIC timer firing at a TSC value
+    TIMER_LAPIC,        // Local APIC timer counting down the bus clock
+    TIMER_PIT,          // Without a local APIC, on the only CPU
+} timer_mode_t;
 
-uint64_t pit_get_ticks() {
-    return pit_ticks;
-}
+typedef struct {
+    timer_t* heap;
+    uint64_t preempt; // End of the running task's slice, 0 for none
+    timer_mode_t mode;
+} cpu_timers_t;
 
-void pit_set_frequency(uint32_t frequency) {
-    if (frequency == 0) return; // Avoid division by zero
+static cpu_timers_t cpu_timers[MAX_CPUS];
 
-    uint32_t divisor = 1193180 / frequency; // PIT clock is 1.19318 MHz
-    outb(0x43, 0x36); // Command byte: binary, mode 3, LSB/MSB
-    outb(0x40, divisor & 0xFF); // Send LSB
-    outb(0x40, (divisor >> 8) & 0xFF); // Send MSB
+static uint64_t tsc_base;
+static uint64_t ns_per_tsc; // 32.32 fixed point
+static uint64_t tsc_per_ns; // 32.32 fixed point
+
+uint64_t clock_ns() {
+    return (unsigned __int128)(rdtsc() - tsc_base) * ns_per_tsc >> 32;
+}
+
+static uint64_t ns_to_tsc(uint64_t ns) {
+    return tsc_base + ((unsigned __int128)ns * tsc_per_ns >> 32);
 }
 
 uint64_t get_uptime_seconds() {
-    return pit_ticks / PIT_FREQUENCY;
+    return clock_ns() / 1000000000;
 }
 
 uint64_t get_uptime_milliseconds() {
-    return (pit_ticks * 1000) / PIT_FREQUENCY;
+    return clock_ns() / 1000000;
+}
+
+// Count ms down on PIT channel 2 in one-shot mode, for calibration without interrupts.
+// Polled with pit_wait_expired(), at most 54 ms.
+void pit_wait_start(uint32_t ms) {
+    uint32_t count = PIT_HZ * ms / 1000;
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01); // Gate channel 2 on, speaker off
+    outb(0x43, 0xB0); // Channel 2, lobyte/hibyte, mode 0
+    outb(0x42, count & 0xFF);
+    outb(0x42, count >> 8);
+    uint8_t gate = inb(0x61) & ~0x01;
+    outb(0x61, gate); // Restart the count with a rising edge on the gate
+    outb(0x61, gate | 0x01);
+}
+
+int pit_wait_expired() {
+    return inb(0x61) & 0x20; // Output goes high at zero
+}
+
+// Interrupt once after ns on IRQ0, with PIT channel 0 in mode 0
+static void pit_arm(uint64_t ns) {
+    if (ns > 50000000) ns = 50000000; // Fires early, and is armed again for the rest
+    uint64_t count = ns * PIT_HZ / 1000000000;
+    if (count == 0) count = 1;
+    outb(0x43, 0x30); // Channel 0, lobyte/hibyte, mode 0
+    outb(0x40, count & 0xFF);
+    outb(0x40, count >> 8);
 }
 
 void timer_init() {
-    pit_set_frequency(PIT_FREQUENCY);
-    pit_ticks = 0; // Reset ticks
+    // The firmware may have left channel 0 periodic, it now fires once and stops
+    pit_arm(50000000);
+
+    pit_wait_start(CALIBRATION_MS);
+    uint64_t start = rdtsc();
+    while (!pit_wait_expired());
+    uint64_t tsc_hz = (rdtsc() - start) * (1000 / CALIBRATION_MS);
+    ns_per_tsc = (1953125ull << 41) / tsc_hz; // 10^9 * 2^32 / tsc_hz
+    tsc_per_ns = (tsc_hz << 23) / 1953125;    // tsc_hz * 2^32 / 10^9
+    tsc_base = rdtsc();
+}
+
+// Pick this CPU's timer hardware, after lapic_init() and lapic_calibrate()
+void timer_start() {
+    cpu_timers_t* timers = &cpu_timers[cpu_id()];
+    if (!lapic_present()) {
+        timers->mode = TIMER_PIT;
+        return;
+    }
+    if (cpu_id() == 0) pic_disable_irq(0);
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    if (ecx & CPUID_TSC_DEADLINE) {
+        lapic_timer_tsc_deadline();
+        timers->mode = TIMER_TSC_DEADLINE;
+    } else {
+        lapic_timer_oneshot();
+        timers->mode = TIMER_LAPIC;
+    }
+}
+
+static timer_t* merge_timers(timer_t* a, timer_t* b) {
+    if (a == NULL) return b;
+    if (b == NULL) return a;
+    if (b->deadline < a->deadline) {
+        timer_t* t = a;
+        a = b;
+        b = t;
+    }
+    timer_t* merged = merge_timers(a->right, b);
+    a->right = a->left;
+    a->left = merged;
+    return a;
+}
+
+// Program the hardware for the earliest deadline, or stop it when nothing is armed
+static void program(cpu_timers_t* timers) {
+    uint64_t deadline = timers->preempt;
+    if (timers->heap && (deadline == 0 || timers->heap->deadline < deadline)) deadline = timers->heap->deadline;
+
+    if (timers->mode == TIMER_TSC_DEADLINE) {
+        wrmsr(MSR_TSC_DEADLINE, deadline ? ns_to_tsc(deadline) : 0);
+        return;
+    }
+    if (deadline == 0) {
+        if (timers->mode == TIMER_LAPIC) lapic_timer_arm(0);
+        return; // A PIT countdown already started ends in one harmless interrupt
+    }
+    uint64_t now = clock_ns();
+    uint64_t ns = deadline > now ? deadline - now : 1;
+    if (timers->mode == TIMER_LAPIC) {
+        lapic_timer_arm(ns);
+    } else if (timers->mode == TIMER_PIT) {
+        pit_arm(ns);
+    }
+}
+
+void timer_arm(timer_t* timer, uint64_t deadline) {
+    uint64_t flags = irq_save();
+    cpu_timers_t* timers = &cpu_timers[cpu_id()];
+    timer->deadline = deadline;
+    timer->left = NULL;
+    timer->right = NULL;
+    timers->heap = merge_timers(timers->heap, timer);
+    if (timers->heap == timer) program(timers);
+    irq_restore(flags);
+}
+
+// End of the running task's slice on this CPU, 0 while there is none
+void timer_set_preempt(uint64_t deadline) {
+    uint64_t flags = irq_save();
+    cpu_timers_t* timers = &cpu_timers[cpu_id()];
+    timers->preempt = deadline;
+    program(timers);
+    irq_restore(flags);
+}
+
+// From the local APIC timer, or IRQ0 on the PIT
+void timer_interrupt(iframe_t* iframe) {
+    cpu_timers_t* timers = &cpu_timers[cpu_id()];
+    uint64_t now = clock_ns();
+    while (timers->heap && timers->heap->deadline <= now) {
+        timer_t* timer = timers->heap;
+        timers->heap = merge_timers(timer->left, timer->right);
+        timer->callback(timer);
+    }
+    if (timers->preempt && timers->preempt <= now) {
+        timers->preempt = 0;
+        this_cpu()->need_resched = 1; // The running task used up its slice
+    }
+    program(timers);
+    preempt_check(iframe); // Also when a timer woke a task that should run first
 }
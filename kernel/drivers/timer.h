@@ -1,10 +1,24 @@
 #pragma once
 
 #include <stdint.h>
+#include "../idt.h"
 
-void pit_tick();
-uint64_t pit_get_ticks();
-void pit_set_frequency(uint32_t frequency);
+// One-shot timer, armed on the CPU that arms it and called there with interrupts disabled
+typedef struct Timer {
+    uint64_t deadline; // clock_ns() it is due at
+    void (*callback)(struct Timer* timer);
+    void* data;
+    struct Timer* left; // Skew heap of the CPU's armed timers
+    struct Timer* right;
+} timer_t;
+
+uint64_t clock_ns();
 uint64_t get_uptime_seconds();
 uint64_t get_uptime_milliseconds();
+void pit_wait_start(uint32_t ms);
+int pit_wait_expired();
 void timer_init();
+void timer_start();
+void timer_arm(timer_t* timer, uint64_t deadline);
+void timer_set_preempt(uint64_t deadline);
+void timer_interrupt(iframe_t* iframe);
@@ -1,6 +1,8 @@
 #include "tty.h"
 #include <stddef.h>
 #include "../memory/mman.h"
+#include "../smp.h"
+#include "../usermode/scheduler.h"
 
 static inline int is_printable(char c) {
     return c >= 0x20 && c <= 0x7E;
@@ -8,6 +10,7 @@ static inline int is_printable(char c) {
 
 void tty_char_recv(tty_t *tty, char c) {
     int erased = 0;
+    int had_input = tty_input_ready(tty);
     if (tty->termios.c_iflag & ISTRIP) c &= 0b01111111;
     if (tty->termios.c_iflag & ICRNL && c == '\r') c = '\n';
     if (tty->termios.c_lflag & ICANON) {
@@ -53,10 +56,17 @@ void tty_char_recv(tty_t *tty, char c) {
             tty->echo(tty, caret, 2);
         }
     }
+    if (!had_input && tty_input_ready(tty)) wake_all(&tty->readers);
 }
 
+int tty_input_ready(tty_t *tty) {
+    return tty->read_head != tty->write_head;
+}
+
+// Blocking spins, for the kernel's own use without a task to block. Syscalls block the task
+// on the tty's readers instead.
 size_t tty_read(tty_t *tty, char *buffer, size_t len, int block) {
-    if (block) while (tty->read_head == tty->write_head);
+    if (block) while (tty->read_head == tty->write_head) kernel_relax();
     int bytes_read = 0;
     for (bytes_read = 0; bytes_read < len; bytes_read++) {
         if (tty->read_head == tty->write_head) return bytes_read;
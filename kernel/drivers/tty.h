@@ -30,8 +30,10 @@ typedef struct tty {
     int write_head;
     char line_buffer[1024];
     int line_index;
+    struct Task* readers; // Blocked until there is input, see block_on()
 } tty_t;
 
 void tty_char_recv(tty_t* tty, char c);
 size_t tty_read(tty_t* tty, char* buffer, size_t len, int block);
+int tty_input_ready(tty_t* tty);
 size_t tty_write(tty_t* tty, const char* buffer, size_t len);
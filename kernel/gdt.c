@@ -1,12 +1,26 @@
 #include "gdt.h"
 #include "memory/mman.h"
+#include "cpu.h"
 #include <stdint.h>
 
 #define GDT_ENTRY_COUNT 7
-uint64_t gdt[GDT_ENTRY_COUNT];
-tss_t tss = {0};
+#define IST_SIZE (4096 * 16)
+
+// Each CPU needs its own TSS for its own interrupt stacks, and so its own GDT, as ltr marks
+// the TSS descriptor busy
+static uint64_t gdts[MAX_CPUS][GDT_ENTRY_COUNT];
+static tss_t tss[MAX_CPUS];
+
+// Called by the BSP for the other CPUs before they start, so they boot without allocating
+void gdt_alloc_stacks(int cpu) {
+    tss[cpu].ist1 = (uint64_t)kmalloc(IST_SIZE) + IST_SIZE;
+    tss[cpu].ist2 = (uint64_t)kmalloc(IST_SIZE) + IST_SIZE;
+}
 
 void gdt_init() {
+    int cpu = cpu_id();
+    uint64_t* gdt = gdts[cpu];
+    if (tss[cpu].ist1 == 0) gdt_alloc_stacks(cpu);
     gdt[0] = 0;
 
     uint64_t kernel_code = 0;
@@ -33,38 +47,36 @@ void gdt_init() {
     uint64_t user_data = kernel_data | (3 << 13);
     gdt[4] = user_data << 32;
 
+    uint64_t base = (uint64_t)&tss[cpu];
     uint64_t tss_low = 0;
-    tss_low |= (sizeof(tss) - 1) & 0xFFFF; // limit
-    tss_low |= ((uint64_t)&tss & 0xFFFFFF) << 16; // base 0-23
+    tss_low |= (sizeof(tss_t) - 1) & 0xFFFF; // limit
+    tss_low |= (base & 0xFFFFFF) << 16; // base 0-23
     tss_low |= (uint64_t)0x9 << 40; // type = TSS, DPL = 0
     tss_low |= 1ULL << 47; // present
-    tss_low |= ((sizeof(tss) - 1) & 0xF0000) << 32; // limit high
-    tss_low |= (((uint64_t)&tss >> 24) & 0xFF) << 56; // base 24-31
-    uint64_t tss_high = ((uint64_t)&tss >> 32) & 0xFFFFFFFF; // base 32-63
+    tss_low |= ((sizeof(tss_t) - 1) & 0xF0000) << 32; // limit high
+    tss_low |= ((base >> 24) & 0xFF) << 56; // base 24-31
+    uint64_t tss_high = (base >> 32) & 0xFFFFFFFF; // base 32-63
 
     gdt[5] = tss_low;
     gdt[6] = tss_high;
 
-    tss.ist1 = (uint64_t)kmalloc(4096 * 16) + 4096 * 16;
-    tss.ist2 = (uint64_t)kmalloc(4096 * 16) + 4096 * 16;
-    tss.rsp0 = 0;
+    tss[cpu].rsp0 = 0;
 
-    gdt_flush();
+    gdt_ptr_t gdt_ptr = {
+        .limit = GDT_ENTRY_COUNT * sizeof(uint64_t) - 1,
+        .base = (uint64_t)gdt,
+    };
+    gdt_flush(&gdt_ptr);
 }
 
-gdt_ptr_t gdt_ptr = {
-    .limit = GDT_ENTRY_COUNT * sizeof(uint64_t) - 1,
-    .base = (uint64_t)gdt,
-};
-
-void gdt_flush() {
+// GS is left alone, loading a selector would clear the GS base that points at this CPU
+void gdt_flush(gdt_ptr_t* gdt_ptr) {
     asm volatile("\
         lgdt %0 \n\
         mov $0x10, %%ax \n\
         mov %%ax, %%ds \n\
         mov %%ax, %%es \n\
         mov %%ax, %%fs \n\
-        mov %%ax, %%gs \n\
         mov %%ax, %%ss \n\
         mov $0x28, %%ax \n\
         ltr %%ax \n\
@@ -74,9 +86,9 @@ void gdt_flush() {
         push %%rax\n\
         lretq\n\
         1:"
-        : : "m"(gdt_ptr) : "rax", "memory" );
+        : : "m"(*gdt_ptr) : "rax", "memory" );
 }
 
 void set_rsp0(uint64_t rsp) {
-    tss.rsp0 = rsp;
+    tss[cpu_id()].rsp0 = rsp;
 }
@@ -24,6 +24,7 @@ typedef struct {
     uint16_t io_map_base;
 } __attribute__((packed)) tss_t;
 
+void gdt_alloc_stacks(int cpu);
 void gdt_init();
-void gdt_flush();
+void gdt_flush(gdt_ptr_t* gdt_ptr);
 void set_rsp0(uint64_t rsp);
@@ -7,6 +7,11 @@
 #include "usermode/scheduler.h"
 #include "usermode/syscalls.h"
 #include "memory/paging.h"
+#include "memory/fault.h"
+#include "memory/kstack.h"
+#include "string.h"
+#include "smp.h"
+#include "io/lapic.h"
 #include <stdint.h>
 
 // ISR handlers (defined in assembly)
@@ -58,7 +63,10 @@ extern void isr44();
 extern void isr45();
 extern void isr46();
 extern void isr47();
+extern void isr48();
+extern void isr49();
 extern void isr128(); // System call handler
+extern void isr255();
 // End of ISR handlers
 
 const char* exception_names[32] = {
@@ -151,14 +159,6 @@ void decode_pfec_flags(uint64_t error_code, char buffer[128]) {
     #undef NEWLINE
 }
 
-static int strcmp(char* p1, char* p2) {
-    while (*p1 && *p2 && *p1 == *p2) {
-        p1++;
-        p2++;
-    };
-    return (unsigned char)*p1 - (unsigned char)*p2;
-}
-
 void breakpoint_debugger(iframe_t* iframe) {
     kprintf("Breakpoint hit at 0x%x\n", iframe->rip - 1);
     char buffer[4096];
@@ -187,19 +187,24 @@ void breakpoint_debugger(iframe_t* iframe) {
     }
 }
 
-void interrupt_handler(iframe_t* iframe) {
+static void dispatch_interrupt(iframe_t* iframe) {
     uint64_t vector = iframe->vector;
     uint64_t error_code = iframe->error_code;
     if (vector == 14) {
         // Page fault
         uint64_t cr2;
         asm volatile("mov %%cr2, %0" : "=r"(cr2));
-        if (error_code & 0x2 && cow_handler((void*)(cr2 & PAGE_MASK))) return; // CoW page
+        // Also resolves kernel accesses to user memory
+        fault_kind_t kind = handle_page_fault(cr2, error_code);
+        if (fault_resolved(kind)) return;
         char flags[128] = {0};
         decode_pfec_flags(error_code, flags);
+        // Syscalls check user buffers up front, so only a fault in user mode is the task's
         if (iframe->cs == USER_CS) {
-            kprintf("Page fault in process with PID %d at address 0x%x, error code: 0x%x\n%s", current_task->pid, cr2, error_code, flags);
-            exit(-vector);
+            kprintf("Page fault in process with PID %d at address 0x%x (%s), error code: 0x%x\n%s", current_task->pid, cr2, fault_kind_name(kind), error_code, flags);
+            exit_from_fault(-vector);
+        } else if (current_task && is_kernel_stack_guard(current_task->kernel_stack, cr2)) {
+            panic_int(iframe->rbp, "Kernel stack overflow in process with PID %d at address: 0x%x\n", current_task->pid, cr2);
         } else {
             panic_int(iframe->rbp, "Page fault in kernel at address: 0x%x, error code: 0x%x\n%s", cr2, error_code, flags);
         }
@@ -213,6 +218,8 @@ void interrupt_handler(iframe_t* iframe) {
         }
     } else if (vector == 3) {
         breakpoint_debugger(iframe);
+    } else if (vector == 7 && iframe->cs == USER_CS) {
+        handle_fpu_trap(); // Device not available, the FPU registers belong to another task
     } else if (vector == 18 || vector == 2 || vector == 10 || vector == 11 || vector == 8 || vector == 28 || vector == 29) { // Serious errors
         panic_int(iframe->rbp, "%s with error code: 0x%x\n", exception_names[vector], error_code);
     } else if (vector < 32) {
@@ -224,14 +231,23 @@ void interrupt_handler(iframe_t* iframe) {
         }
     } else if (vector == 128) {
         syscall(iframe->rax, iframe->rdi, iframe->rsi, iframe->rdx, iframe->r10, iframe->r8, iframe->r9, iframe);
-        if (ticks_remaining <= 0 && iframe->cs == USER_CS) {
-            run_next(iframe); // Next task
-        }
+        preempt_check(iframe);
+    } else if (vector == LAPIC_TIMER_VECTOR || vector == RESCHEDULE_VECTOR || vector == SPURIOUS_VECTOR) {
+        lapic_interrupt(vector, iframe);
     } else {
         irq_handler(vector - 32, iframe);
     }
 }
 
+// Every way into the kernel comes through here and holds the big kernel lock for the duration,
+// paths that switch tasks instead of returning drop it in context_switch()
+void interrupt_handler(iframe_t* iframe) {
+    kernel_lock();
+    dispatch_interrupt(iframe);
+    asm volatile("cli"); // Syscalls turn interrupts on, one taken between these would find the lock still counted
+    kernel_unlock();
+}
+
 void idt_set_entry(int vec, void (*isr)(), uint16_t selector, uint8_t type_attr, uint8_t ist){
     uint64_t isr_address = (uint64_t)isr;
     idt[vec].offset_low = isr_address & 0xFFFF;
@@ -299,9 +315,17 @@ void idt_init() {
     idt_set_entry(45, isr45, KERNEL_CS, 0x8E, 0);
     idt_set_entry(46, isr46, KERNEL_CS, 0x8E, 0);
     idt_set_entry(47, isr47, KERNEL_CS, 0x8E, 0);
+    idt_set_entry(LAPIC_TIMER_VECTOR, isr48, KERNEL_CS, 0x8E, 0);
+    idt_set_entry(RESCHEDULE_VECTOR, isr49, KERNEL_CS, 0x8E, 0);
     idt_set_entry(128, isr128, KERNEL_CS, 0xEE, 0);
+    idt_set_entry(SPURIOUS_VECTOR, isr255, KERNEL_CS, 0x8E, 0);
     // Load the IDT
     idt_load(&idt_ptr);
     // Enable interrupts
     asm volatile("sti");
 }
+
+// The other CPUs share the IDT the BSP built
+void idt_init_ap() {
+    idt_load(&idt_ptr);
+}
@@ -49,3 +49,4 @@ void idt_set_entry(int vec, void (*isr)(), uint16_t selector, uint8_t type_attr,
 void interrupt_handler(iframe_t* iframe);
 void idt_load(idt_ptr_t* idt_ptr);
 void idt_init();
+void idt_init_ap();
@@ -86,18 +86,12 @@ void pic_init() {
 }
 
 void irq0_handler(iframe_t* iframe) {
-    // Handle IRQ0 (timer interrupt)
-
-    pit_tick();
+    // Handle IRQ0 (timer interrupt), only unmasked when the PIT is the timer
 
     // Acknowledge the interrupt
     pic_send_eoi(0); // Send EOI to PIC for IRQ0
 
-    check_blocked_tasks(1);
-    ticks_remaining--;
-    if (ticks_remaining <= 0 && iframe->cs == USER_CS) {
-        run_next(iframe); // Next task
-    }
+    timer_interrupt(iframe);
 }
 
 void irq1_handler() {
@@ -0,0 +1,93 @@
+#include "lapic.h"
+#include "../cpu.h"
+#include "../memory/mman.h"
+#include "../memory/paging.h"
+#include "../usermode/scheduler.h"
+#include "../drivers/timer.h"
+#include <stdint.h>
+
+#define CALIBRATION_MS 10
+
+static volatile uint32_t* lapic = NULL;
+static uint32_t timer_ticks_per_ms = 0;
+
+static uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+int lapic_present() {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    return (edx >> 9) & 1;
+}
+
+// The first call maps the registers, they are at the same physical address on every CPU
+void lapic_init() {
+    if (lapic == NULL) {
+        uintptr_t phys = rdmsr(MSR_APIC_BASE) & PAGE_MASK;
+        lapic = alloc_mmio_region((uintptr_t)find_available_va(1), phys, PAGE_SIZE, FLAGS_RW | FLAGS_PCD | FLAGS_PWT);
+    }
+    lapic_write(LAPIC_SPURIOUS, LAPIC_ENABLE | SPURIOUS_VECTOR);
+}
+
+// Count timer ticks across a known delay, timed by PIT channel 2 so that no interrupts are
+// needed. The bus clock is the same on every CPU.
+void lapic_calibrate() {
+    lapic_write(LAPIC_TIMER_DIVIDE, 0x3); // Divide by 16
+    pit_wait_start(CALIBRATION_MS);
+    lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+    while (!pit_wait_expired());
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+
+    timer_ticks_per_ms = elapsed / CALIBRATION_MS;
+}
+
+// Fire once at the TSC value written to MSR_TSC_DEADLINE
+void lapic_timer_tsc_deadline() {
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_TSC_DEADLINE | LAPIC_TIMER_VECTOR);
+    asm volatile("mfence" ::: "memory"); // The mode change must land before the MSR write
+}
+
+// Fire once when the count set by lapic_timer_arm() runs out
+void lapic_timer_oneshot() {
+    lapic_write(LAPIC_TIMER_DIVIDE, 0x3);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR);
+}
+
+// Longer delays than the counter holds fire early, 0 stops the timer
+void lapic_timer_arm(uint64_t ns) {
+    uint64_t longest = 0xFFFFFFFFull * 1000000 / timer_ticks_per_ms;
+    if (ns > longest) ns = longest;
+    uint64_t count = ns * timer_ticks_per_ms / 1000000;
+    if (ns && count == 0) count = 1;
+    lapic_write(LAPIC_TIMER_INITIAL, count);
+}
+
+void lapic_eoi() {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector) {
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_DELIVERY_PENDING) asm volatile("pause");
+    lapic_write(LAPIC_ICR_HIGH, lapic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, vector); // Fixed delivery, physical destination
+}
+
+uint32_t lapic_id() {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_interrupt(uint64_t vector, iframe_t* iframe) {
+    if (vector == SPURIOUS_VECTOR) return; // Not acknowledged
+    lapic_eoi();
+    if (vector == LAPIC_TIMER_VECTOR) {
+        timer_interrupt(iframe);
+    } else {
+        preempt_check(iframe); // A reschedule IPI wakes an idle CPU or preempts its task
+    }
+}
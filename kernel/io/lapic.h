@@ -0,0 +1,33 @@
+#pragma once
+#include <stdint.h>
+#include "../idt.h"
+
+// Register offsets in the xAPIC MMIO page
+#define LAPIC_ID 0x20
+#define LAPIC_EOI 0xB0
+#define LAPIC_SPURIOUS 0xF0
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+
+#define LAPIC_ENABLE (1 << 8)
+#define LAPIC_DELIVERY_PENDING (1 << 12)
+#define LAPIC_TIMER_TSC_DEADLINE (2 << 17)
+
+#define LAPIC_TIMER_VECTOR 48
+#define RESCHEDULE_VECTOR 49
+#define SPURIOUS_VECTOR 255
+
+int lapic_present();
+void lapic_init();
+void lapic_calibrate();
+void lapic_timer_tsc_deadline();
+void lapic_timer_oneshot();
+void lapic_timer_arm(uint64_t ns);
+void lapic_eoi();
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector);
+uint32_t lapic_id();
+void lapic_interrupt(uint64_t vector, iframe_t* iframe);
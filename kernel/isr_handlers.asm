@@ -48,9 +48,17 @@ global isr44
 global isr45
 global isr46
 global isr47
+global isr48
+global isr49
 global isr128
+global isr255
 
 isr_common:
+    cld               ; User mode may enter with DF set, the kernel's rep movs/stos count up
+    test qword [rsp + 24], 3 ; Coming from user mode, CS is above the vector, error code and RIP
+    jz .from_kernel
+    swapgs            ; GS base back to this CPU
+.from_kernel:
     push rax          ; Save registers
     push rbx
     push rcx
@@ -85,6 +93,10 @@ isr_common:
     pop rbx
     pop rax
     add rsp, 16
+    test qword [rsp + 8], 3
+    jz .to_kernel
+    swapgs            ; GS base back to the user's
+.to_kernel:
     iretq
 
 isr0: ; Division by zero
@@ -316,7 +328,22 @@ isr47: ; IRQ15
     push 47
     jmp isr_common
 
+isr48: ; Local APIC timer
+    push 0
+    push 48
+    jmp isr_common
+
+isr49: ; Reschedule IPI
+    push 0
+    push 49
+    jmp isr_common
+
 isr128: ; System call
     push 0
     push 128
     jmp isr_common
+
+isr255: ; Local APIC spurious interrupt
+    push 0
+    push 255
+    jmp isr_common
@@ -3,6 +3,7 @@
 #include "panic.h"
 #include "memory/mman.h"
 #include "memory/paging.h"
+#include "string.h"
 #include "drivers/block/ata.h"
 #include "mount.h"
 #include "gdt.h"
@@ -15,6 +16,7 @@
 #include "drivers/serial.h"
 #include "usermode/scheduler.h"
 #include "user_jump.h"
+#include "smp.h"
 #include <stdint.h>
 
 extern uint64_t __size;
@@ -56,6 +58,12 @@ static volatile struct limine_executable_cmdline_request cmdline_request = {
     .revision = 0
 };
 
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_smp_request smp_request = {
+    .id = LIMINE_SMP_REQUEST,
+    .revision = 0
+};
+
 __attribute__((used, section(".limine_requests_end")))
 static volatile LIMINE_REQUESTS_END_MARKER;
 
@@ -142,6 +150,8 @@ void kernel_main() {
         "mov %%cr3, %0"
         : "=r"(cr3)
     );
+    init_cpu_local(0);
+    init_string();
     init_paging(cr3, memmap_request.response, hhdm_request.response->offset);
     init_mman((size_t)&__size);
     gdt_init();
@@ -155,6 +165,7 @@ void kernel_main() {
     register_rtl8139_driver();
     enumerate_pci();
     init_fpu();
+    start_aps(smp_request.response);
 
     parse_kernel_cmdline();
 
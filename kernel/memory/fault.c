@@ -0,0 +1,177 @@
+#include "fault.h"
+#include "paging.h"
+#include "vma.h"
+#include "mman.h"
+#include "kstack.h"
+#include "../mount.h"
+#include "../usermode/scheduler.h"
+#include "../usermode/mmap.h"
+#include <stddef.h>
+#include <stdint.h>
+
+fault_stats_t fault_totals = {0};
+
+extern uint64_t file_cache_hits;
+extern uint64_t file_cache_misses;
+
+// Present page, write access: copy-on-write at the page or at a page table above it
+static fault_kind_t resolve_write(uintptr_t page) {
+    uint64_t unshared = unshared_tables;
+    uint64_t* pte = get_pte(page, 0, 0);
+    if (pte == NULL || !(*pte & FLAGS_PRESENT)) return FAULT_INVALID;
+    if (*pte & FLAGS_COW) {
+        int copied = break_cow(pte, page);
+        if (copied < 0) return FAULT_OOM;
+        return copied ? FAULT_COW_COPY : FAULT_COW_REUSE;
+    }
+    if (unshared != unshared_tables) return FAULT_TABLE;
+    return FAULT_INVALID;
+}
+
+// Missing page, populate it from the area it belongs to with a single table walk
+static fault_kind_t resolve_missing(task_t* task, uintptr_t addr, int write) {
+    uintptr_t page = addr & PAGE_MASK;
+    vma_t* vma = vma_find(task->vmas, addr);
+    if (vma == NULL) {
+        if (page == USER_STACK_BASE - PAGE_SIZE) return FAULT_GUARD; // Stack overflow
+        return FAULT_INVALID;
+    }
+    if (!(vma->flags & FLAGS_USER)) return FAULT_GUARD; // PROT_NONE areas are never populated
+
+    // The page cache may read from disk, do it before holding on to a page table entry
+    uintptr_t phys = 0;
+    fault_kind_t kind = FAULT_ZERO_FILL;
+    uint64_t flags = vma->flags;
+    if (vma->file) {
+        uint64_t misses = file_cache_misses;
+        phys = get_cached_page(vma->file, (vma->offset + page - vma->start) / PAGE_SIZE);
+        if (phys) {
+            kind = misses != file_cache_misses ? FAULT_FILE_READ : FAULT_FILE;
+            // Every mapping shares the cached frame, writers get a private copy on their first write
+            if (flags & FLAGS_RW) flags = (flags & ~FLAGS_RW) | FLAGS_COW;
+        }
+        // Past the end of the file, fall back to a zero-filled page
+    }
+    if (!phys && !write) {
+        // Reads of untouched memory share the zero page until the first write, which charges it
+        phys = zero_page;
+        kind = FAULT_ZERO_PAGE;
+        if (flags & FLAGS_RW) flags = (flags & ~FLAGS_RW) | FLAGS_COW;
+    } else if (over_memory_limit(1)) {
+        return FAULT_OOM;
+    } else if (!phys) {
+        phys = alloc_zeroed_frame();
+        if (!phys) return FAULT_OOM;
+    }
+
+    uint64_t* pte = get_pte(page, flags, 1);
+    if (*pte & FLAGS_PRESENT) {
+        if (kind == FAULT_ZERO_FILL) free_frame(phys);
+        return FAULT_TABLE; // Mapped in the meantime
+    }
+    ref_frame(phys);
+    *pte = phys | flags | FLAGS_PRESENT;
+    if (kind != FAULT_ZERO_PAGE) account_user_pages(page, 1);
+    return kind;
+}
+
+static void count_fault(fault_stats_t* stats, fault_kind_t kind) {
+    switch (kind) {
+    case FAULT_INVALID:
+    case FAULT_OOM:
+        stats->invalid++;
+        return;
+    case FAULT_GUARD: stats->guard_hits++; return;
+    case FAULT_ZERO_FILL: stats->zero_fills++; break;
+    case FAULT_ZERO_PAGE: stats->zero_page_maps++; break;
+    case FAULT_FILE: stats->file_pages++; break;
+    case FAULT_FILE_READ:
+        stats->file_pages++;
+        stats->major++;
+        return;
+    case FAULT_COW_COPY: stats->cow_copies++; break;
+    case FAULT_COW_REUSE: stats->cow_reuses++; break;
+    case FAULT_TABLE: break;
+    }
+    stats->minor++;
+}
+
+// Whether the faulting access can be retried
+int fault_resolved(fault_kind_t kind) {
+    return kind != FAULT_INVALID && kind != FAULT_GUARD && kind != FAULT_OOM;
+}
+
+// Classify and, where possible, resolve a page fault on a lower-half address
+fault_kind_t handle_page_fault(uintptr_t addr, uint64_t error_code) {
+    fault_kind_t kind = FAULT_INVALID;
+    if (addr < USER_SPACE_END) {
+        if (!(error_code & PF_PRESENT)) {
+            kind = resolve_missing(current_task, addr, error_code & PF_WRITE);
+        } else if (error_code & PF_WRITE) {
+            kind = resolve_write(addr & PAGE_MASK);
+        }
+    }
+    if (current_task) count_fault(&current_task->faults, kind);
+    count_fault(&fault_totals, kind);
+    return kind;
+}
+
+// Check a user buffer a syscall is about to use and fault it in up front, so that the kernel
+// never faults on it: a bad buffer fails the syscall instead, and the filesystem is never
+// re-entered from a fault taken halfway through a read or write. Buffers the kernel is about
+// to write get private, writable frames right away. Returns -1 if part of the buffer is not
+// mapped for the access, or can't be backed.
+int access_user_range(uintptr_t start, size_t size, int write) {
+    uintptr_t end = start + size;
+    if (end < start || end > USER_SPACE_END) return -1;
+    uint64_t required = write ? FLAGS_USER | FLAGS_RW : FLAGS_USER;
+    for (uintptr_t page = start & PAGE_MASK; page < end; page += PAGE_SIZE) {
+        vma_t* vma = vma_find(current_task->vmas, page);
+        if (vma == NULL || (vma->flags & required) != required) return -1;
+        if (!write) {
+            if (!get_physical_address(page) && !fault_resolved(handle_page_fault(page, 0))) return -1;
+            continue;
+        }
+        // A copy-on-write page under a shared page table takes two faults, one for each
+        for (int tries = 0; !writable_user_address(current_task->cr3, page); tries++) {
+            uint64_t error_code = PF_WRITE | (get_physical_address(page) ? PF_PRESENT : 0);
+            if (tries == 2 || !fault_resolved(handle_page_fault(page, error_code))) return -1;
+        }
+    }
+    return 0;
+}
+
+// Same for a NUL-terminated string, which has to end within max bytes
+int access_user_string(uintptr_t start, size_t max) {
+    for (uintptr_t addr = start; addr < start + max; addr++) {
+        if ((addr == start || !(addr & (PAGE_SIZE - 1))) && access_user_range(addr, 1, 0)) return -1;
+        if (*(const char*)addr == '\0') return 0;
+    }
+    return -1;
+}
+
+int get_fault_stats(int scope, fault_stats_t* stats) {
+    if (scope == FAULT_STATS_SELF) {
+        *stats = current_task->faults;
+    } else if (scope == FAULT_STATS_SYSTEM) {
+        *stats = fault_totals;
+        stats->zero_pool_hits = zero_pool_hits;
+        stats->zero_pool_misses = zero_pool_misses;
+        stats->file_cache_hits = file_cache_hits;
+        stats->file_cache_misses = file_cache_misses;
+        stats->kernel_stack_hits = kernel_stack_hits;
+        stats->kernel_stack_misses = kernel_stack_misses;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+const char* fault_kind_name(fault_kind_t kind) {
+    switch (kind) {
+    case FAULT_GUARD: return "guard page";
+    case FAULT_OOM: return "out of memory";
+    case FAULT_INVALID: return "unmapped or protected address";
+    default: return "resolved";
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define PF_PRESENT 0x1
+#define PF_WRITE   0x2
+#define PF_USER    0x4
+
+#define FAULT_STATS_SELF 0
+#define FAULT_STATS_SYSTEM 1
+
+typedef enum {
+    FAULT_INVALID,    // Not backed by anything, the access is a bug
+    FAULT_GUARD,      // Hit a PROT_NONE area or the page below the user stack
+    FAULT_OOM,        // Out of memory, or past the task's memory limit
+    FAULT_ZERO_FILL,  // First write to anonymous memory
+    FAULT_ZERO_PAGE,  // First read of anonymous memory, mapped to the shared zero page
+    FAULT_FILE,       // File page already in the page cache
+    FAULT_FILE_READ,  // File page that had to be read from disk
+    FAULT_COW_COPY,   // Write to a shared page, copied
+    FAULT_COW_REUSE,  // Write to a copy-on-write page nobody else uses anymore
+    FAULT_TABLE,      // Only a shared page table had to be made private
+} fault_kind_t;
+
+// Same layout as the user space struct in libc/mman.h
+typedef struct {
+    uint64_t minor;      // Resolved without I/O
+    uint64_t major;      // Resolved by reading from disk
+    uint64_t zero_fills;
+    uint64_t file_pages;
+    uint64_t cow_copies;
+    uint64_t cow_reuses;
+    uint64_t guard_hits;
+    uint64_t invalid;    // Faults that killed the task, out of memory included
+    uint64_t zero_page_maps;
+    // Only filled in for FAULT_STATS_SYSTEM, the kernel's caches
+    uint64_t zero_pool_hits;      // Cleared frames taken from the pool filled while idle
+    uint64_t zero_pool_misses;
+    uint64_t file_cache_hits;     // File page lookups found in the page cache
+    uint64_t file_cache_misses;
+    uint64_t kernel_stack_hits;   // New tasks given a pooled kernel stack
+    uint64_t kernel_stack_misses;
+} fault_stats_t;
+
+extern fault_stats_t fault_totals;
+
+fault_kind_t handle_page_fault(uintptr_t addr, uint64_t error_code);
+int fault_resolved(fault_kind_t kind);
+int access_user_range(uintptr_t start, size_t size, int write);
+int access_user_string(uintptr_t start, size_t max);
+int get_fault_stats(int scope, fault_stats_t* stats);
+const char* fault_kind_name(fault_kind_t kind);
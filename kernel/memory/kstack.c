@@ -0,0 +1,41 @@
+#include "kstack.h"
+#include "mman.h"
+#include "paging.h"
+#include "../panic.h"
+#include <stdint.h>
+
+// Every stack gets its own window of kernel heap addresses with the lowest page left
+// unmapped, so running off the bottom faults instead of overwriting whatever lies below.
+// Stacks of exited tasks go back to a pool and are handed out again still mapped.
+static void* stack_pool[KERNEL_STACK_POOL_SIZE];
+static int stack_pool_count = 0;
+uint64_t kernel_stack_hits = 0;
+uint64_t kernel_stack_misses = 0;
+
+// Returns the top of the stack
+void* alloc_kernel_stack() {
+    if (stack_pool_count) {
+        kernel_stack_hits++;
+        return stack_pool[--stack_pool_count];
+    }
+
+    kernel_stack_misses++;
+    uintptr_t guard = (uintptr_t)find_available_va(KERNEL_STACK_SIZE / PAGE_SIZE + 1);
+    if (!alloc_region(guard + PAGE_SIZE, KERNEL_STACK_SIZE, FLAGS_RW)) {
+        panic("Out of memory: kernel stack");
+    }
+    return (void*)(guard + PAGE_SIZE + KERNEL_STACK_SIZE);
+}
+
+void free_kernel_stack(void* top) {
+    if (stack_pool_count < KERNEL_STACK_POOL_SIZE) {
+        stack_pool[stack_pool_count++] = top;
+        return;
+    }
+    kfree((char*)top - KERNEL_STACK_SIZE - PAGE_SIZE); // The allocation starts at the guard page
+}
+
+int is_kernel_stack_guard(void* top, uintptr_t addr) {
+    uintptr_t bottom = (uintptr_t)top - KERNEL_STACK_SIZE;
+    return top && addr < bottom && addr >= bottom - PAGE_SIZE;
+}
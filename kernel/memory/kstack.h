@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+
+#define KERNEL_STACK_SIZE (4096 * 32)
+#define KERNEL_STACK_POOL_SIZE 32 // Freed stacks kept mapped for the next task
+
+extern uint64_t kernel_stack_hits;
+extern uint64_t kernel_stack_misses;
+
+void* alloc_kernel_stack();
+void free_kernel_stack(void* top);
+int is_kernel_stack_guard(void* top, uintptr_t addr);
@@ -1,73 +1,214 @@
 #include "mman.h"
 #include "paging.h"
+#include "slab.h"
 #include "../panic.h"
 #include <stddef.h>
 #include <stdint.h>
 
 uintptr_t kernel_heap_start;
 
-typedef struct {
+// Every kernel heap address range, free or allocated, is described by one
+// region. Regions are kept in an AVL tree keyed by start address so that
+// kfree() and coalescing with neighbours are O(log n), and free regions are
+// additionally linked into buckets by floor(log2(pages)).
+typedef struct HeapRegion {
     uintptr_t start;
-    int pages;
+    size_t pages;
     uint8_t free;
-} mapped_region;
+    int8_t height;
+    struct HeapRegion* left;
+    struct HeapRegion* right;
+    struct HeapRegion* bucket_next;
+    struct HeapRegion* bucket_prev;
+} heap_region_t;
 
-mapped_region map[ALLOC_MAP_SIZE] = {0};
-uint64_t map_index = 0;
+heap_region_t* region_tree = NULL;
+heap_region_t* free_buckets[HEAP_BUCKETS] = {0};
+uint64_t nonempty_buckets = 0;
 
-void init_mman(size_t executable_size) {
-    kernel_heap_start = PAGE_ALIGN(0xFFFFFFFF80000000ULL + executable_size);
-    map[0].start = kernel_heap_start;
-    map[0].pages = 0xFFFFFFFFF - (kernel_heap_start/PAGE_SIZE);
-    map[0].free = 1;
-    map_index = 1;
+// Region descriptors live in their own window at the start of the heap, mapped
+// on demand, so growing the tracker never recurses into kmalloc()
+uintptr_t region_pool_next;
+uintptr_t region_pool_mapped;
+uintptr_t region_pool_end;
+heap_region_t* region_pool_free = NULL;
+
+static heap_region_t* new_region(uintptr_t start, size_t pages, uint8_t free) {
+    heap_region_t* region = region_pool_free;
+    if (region) {
+        region_pool_free = region->bucket_next;
+    } else {
+        if (region_pool_next + sizeof(heap_region_t) > region_pool_end) panic("Out of kernel heap region descriptors");
+        while (region_pool_next + sizeof(heap_region_t) > region_pool_mapped) {
+            alloc_page(region_pool_mapped, FLAGS_PRESENT | FLAGS_RW);
+            region_pool_mapped += PAGE_SIZE;
+        }
+        region = (heap_region_t*)region_pool_next;
+        region_pool_next += sizeof(heap_region_t);
+    }
+    region->start = start;
+    region->pages = pages;
+    region->free = free;
+    region->height = 1;
+    region->left = NULL;
+    region->right = NULL;
+    region->bucket_next = NULL;
+    region->bucket_prev = NULL;
+    return region;
 }
 
-int memcmp(const void *ptr1, const void *ptr2, size_t n){
-    const unsigned char *p1 = (const unsigned char *)ptr1;
-    const unsigned char *p2 = (const unsigned char *)ptr2;
+static void release_region(heap_region_t* region) {
+    region->bucket_next = region_pool_free;
+    region_pool_free = region;
+}
 
-    for (size_t i = 0; i < n; i++) {
-        if (p1[i] != p2[i]) {
-            return p1[i] - p2[i];
-        }
+static int bucket_of(size_t pages) {
+    return 63 - __builtin_clzll(pages);
+}
+
+static void bucket_insert(heap_region_t* region) {
+    int b = bucket_of(region->pages);
+    region->bucket_prev = NULL;
+    region->bucket_next = free_buckets[b];
+    if (free_buckets[b]) free_buckets[b]->bucket_prev = region;
+    free_buckets[b] = region;
+    nonempty_buckets |= 1ULL << b;
+}
+
+static void bucket_remove(heap_region_t* region) {
+    int b = bucket_of(region->pages);
+    if (region->bucket_prev) region->bucket_prev->bucket_next = region->bucket_next;
+    else free_buckets[b] = region->bucket_next;
+    if (region->bucket_next) region->bucket_next->bucket_prev = region->bucket_prev;
+    if (free_buckets[b] == NULL) nonempty_buckets &= ~(1ULL << b);
+    region->bucket_next = NULL;
+    region->bucket_prev = NULL;
+}
+
+static int region_height(heap_region_t* n) {
+    return n ? n->height : 0;
+}
+
+static void update_height(heap_region_t* n) {
+    int l = region_height(n->left);
+    int r = region_height(n->right);
+    n->height = (l > r ? l : r) + 1;
+}
+
+static heap_region_t* rotate_right(heap_region_t* n) {
+    heap_region_t* l = n->left;
+    n->left = l->right;
+    l->right = n;
+    update_height(n);
+    update_height(l);
+    return l;
+}
+
+static heap_region_t* rotate_left(heap_region_t* n) {
+    heap_region_t* r = n->right;
+    n->right = r->left;
+    r->left = n;
+    update_height(n);
+    update_height(r);
+    return r;
+}
+
+static heap_region_t* rebalance(heap_region_t* n) {
+    update_height(n);
+    int balance = region_height(n->left) - region_height(n->right);
+    if (balance > 1) {
+        if (region_height(n->left->left) < region_height(n->left->right)) n->left = rotate_left(n->left);
+        return rotate_right(n);
     }
-    return 0; // Memory regions are equal
+    if (balance < -1) {
+        if (region_height(n->right->right) < region_height(n->right->left)) n->right = rotate_right(n->right);
+        return rotate_left(n);
+    }
+    return n;
 }
 
-void* memcpy(void* dest, const void* src, size_t n) {
-    unsigned char *d = (unsigned char *)dest;
-    const unsigned char *s = (const unsigned char *)src;
+static heap_region_t* tree_insert(heap_region_t* root, heap_region_t* region) {
+    if (root == NULL) return region;
+    if (region->start < root->start) root->left = tree_insert(root->left, region);
+    else root->right = tree_insert(root->right, region);
+    return rebalance(root);
+}
 
-    for (size_t i = 0; i < n; i++) {
-        d[i] = s[i];
+static heap_region_t* tree_remove_min(heap_region_t* root, heap_region_t** min) {
+    if (root->left == NULL) {
+        *min = root;
+        return root->right;
     }
-    return dest;
+    root->left = tree_remove_min(root->left, min);
+    return rebalance(root);
 }
 
-void* memset(void* ptr, unsigned char value, size_t n) {
-    unsigned char *p = (unsigned char *)ptr;
+static heap_region_t* tree_remove(heap_region_t* root, uintptr_t start) {
+    if (root == NULL) return NULL;
+    if (start < root->start) {
+        root->left = tree_remove(root->left, start);
+    } else if (start > root->start) {
+        root->right = tree_remove(root->right, start);
+    } else {
+        if (root->left == NULL) return root->right;
+        if (root->right == NULL) return root->left;
+        heap_region_t* successor;
+        root->right = tree_remove_min(root->right, &successor);
+        successor->left = root->left;
+        successor->right = root->right;
+        root = successor;
+    }
+    return rebalance(root);
+}
 
-    for (size_t i = 0; i < n; i++) {
-        p[i] = value;
+static heap_region_t* tree_find(uintptr_t start) {
+    heap_region_t* n = region_tree;
+    while (n && n->start != start) {
+        n = start < n->start ? n->left : n->right;
     }
-    return ptr;
+    return n;
 }
 
-void* memmove(void* dest, const void* src, size_t n) {
-    unsigned char *d = (unsigned char *)dest;
-    const unsigned char *s = (const unsigned char *)src;
+// Region with the largest start below the given address
+static heap_region_t* tree_prev(uintptr_t start) {
+    heap_region_t* n = region_tree;
+    heap_region_t* best = NULL;
+    while (n) {
+        if (n->start < start) {
+            best = n;
+            n = n->right;
+        } else {
+            n = n->left;
+        }
+    }
+    return best;
+}
 
-    if (d < s || d >= s + n) {
-        // Non-overlapping regions
-        return memcpy(dest, src, n);
-    } else {
-        // Overlapping regions
-        for (size_t i = n; i > 0; i--) {
-            d[i - 1] = s[i - 1];
+// Region with the smallest start above the given address
+static heap_region_t* tree_next(uintptr_t start) {
+    heap_region_t* n = region_tree;
+    heap_region_t* best = NULL;
+    while (n) {
+        if (n->start > start) {
+            best = n;
+            n = n->left;
+        } else {
+            n = n->right;
         }
     }
-    return dest;
+    return best;
+}
+
+void init_mman(size_t executable_size) {
+    kernel_heap_start = PAGE_ALIGN(0xFFFFFFFF80000000ULL + executable_size);
+    region_pool_next = kernel_heap_start;
+    region_pool_mapped = kernel_heap_start;
+    region_pool_end = kernel_heap_start + HEAP_REGION_POOL_SIZE;
+
+    uintptr_t heap_start = region_pool_end;
+    heap_region_t* all = new_region(heap_start, (0 - heap_start) / PAGE_SIZE, 1);
+    region_tree = tree_insert(region_tree, all);
+    bucket_insert(all);
 }
 
 void kfree(void *ptr) {
@@ -75,53 +216,116 @@ void kfree(void *ptr) {
         return; // Nothing to free
     }
 
-    uint64_t pointer_map_index = 0;
+    if ((uintptr_t)ptr & (PAGE_SIZE - 1)) {
+        slab_free(ptr); // Small allocations never start on a page boundary
+        return;
+    }
 
-    uintptr_t address = (uintptr_t)ptr;
-    size_t size = 0;
-    for (uint64_t i = 0; i < map_index; i++) {
-        if (map[i].start == address) {
-            pointer_map_index = i;
-            size = map[i].pages * PAGE_SIZE;
-        }
+    heap_region_t* region = tree_find((uintptr_t)ptr);
+    if (region == NULL || region->free) {
+        return; // Not the start of a live allocation
     }
 
     // Free the pages allocated for this pointer
-    for (size_t i = 0; i < size; i += PAGE_SIZE) {
-        free_page((void*)(address + i));
+    free_region(region->start, region->pages * PAGE_SIZE);
+    region->free = 1;
+
+    // Coalesce with free neighbours
+    heap_region_t* prev = tree_prev(region->start);
+    if (prev && prev->free && prev->start + prev->pages * PAGE_SIZE == region->start) {
+        bucket_remove(prev);
+        prev->pages += region->pages;
+        region_tree = tree_remove(region_tree, region->start);
+        release_region(region);
+        region = prev;
     }
+    heap_region_t* next = tree_next(region->start);
+    if (next && next->free && region->start + region->pages * PAGE_SIZE == next->start) {
+        bucket_remove(next);
+        region->pages += next->pages;
+        region_tree = tree_remove(region_tree, next->start);
+        release_region(next);
+    }
+    bucket_insert(region);
+}
 
-    // Mark the region as free
-    map[pointer_map_index].free = 1;
+// Pages that have to be skipped at the start of region to reach the given alignment
+static size_t align_padding(heap_region_t* region, size_t align) {
+    uintptr_t aligned = (region->start + align - 1) & ~(align - 1);
+    return (aligned - region->start) / PAGE_SIZE;
 }
 
-void* find_available_va(size_t size) {
-    for (int i = 0; i <= map_index; i++) {
-        if (map[i].free && map[i].pages >= size) {
-            if (map[i].pages > size) {
-                map[map_index].free = 1;
-                map[map_index].start = map[i].start + size * PAGE_SIZE;
-                map[map_index].pages = map[i].pages - size;
-
-                map_index++;
-                if (map_index >= ALLOC_MAP_SIZE) panic("Too many kernel allocations");
-            }
-            map[i].pages = size;
-            map[i].free = 0;
+void* find_available_va_aligned(size_t size, size_t align) {
+    heap_region_t* region = NULL;
+    // Worst case padding, so any region from the bucket search is guaranteed to fit
+    size_t needed = size + (align > PAGE_SIZE ? align / PAGE_SIZE - 1 : 0);
 
-            return (void*)(map[i].start);
+    // Any region in a bucket at or above ceil(log2(needed)) is large enough
+    int b = bucket_of(needed);
+    if (needed & (needed - 1)) b++;
+    uint64_t candidates = b < HEAP_BUCKETS ? nonempty_buckets >> b : 0;
+    if (candidates) {
+        region = free_buckets[b + __builtin_ctzll(candidates)];
+    } else {
+        // Fall back to searching the buckets that may hold an exact fit
+        for (int i = bucket_of(size); i < HEAP_BUCKETS && region == NULL; i++) {
+            for (heap_region_t* r = free_buckets[i]; r; r = r->bucket_next) {
+                if (r->pages >= size + align_padding(r, align)) {
+                    region = r;
+                    break;
+                }
+            }
         }
     }
-    panic("Out of kernel heap addresses");
+    if (region == NULL) panic("Out of kernel heap addresses");
+
+    bucket_remove(region);
+    size_t lead = align_padding(region, align);
+    if (lead) {
+        // Leave the unaligned head behind as a free region of its own
+        heap_region_t* aligned = new_region(region->start + lead * PAGE_SIZE, region->pages - lead, 1);
+        region->pages = lead;
+        region_tree = tree_insert(region_tree, aligned);
+        bucket_insert(region);
+        region = aligned;
+    }
+    if (region->pages > size) {
+        heap_region_t* rest = new_region(region->start + size * PAGE_SIZE, region->pages - size, 1);
+        region_tree = tree_insert(region_tree, rest);
+        bucket_insert(rest);
+    }
+    region->pages = size;
+    region->free = 0;
+    return (void*)region->start;
+}
+
+void* find_available_va(size_t size) {
+    return find_available_va_aligned(size, PAGE_SIZE);
 }
 
 void* kmalloc(size_t size) {
-    void* ptr = find_available_va(PAGE_ALIGN(size) / PAGE_SIZE);
+    if (size <= SLAB_MAX_SIZE) {
+        return slab_alloc(size);
+    }
+
+    // Large allocations get a 2 MiB aligned address so alloc_region can back them with huge pages
+    size_t align = size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : PAGE_SIZE;
+    void* ptr = find_available_va_aligned(PAGE_ALIGN(size) / PAGE_SIZE, align);
     // Allocate memory of the specified size
-    for (int i=0; i < PAGE_ALIGN(size); i += PAGE_SIZE) {
-        alloc_page((uintptr_t)ptr + i, FLAGS_PRESENT | FLAGS_RW);
+    if (!alloc_region((uintptr_t)ptr, size, FLAGS_RW)) {
+        panic("Out of memory: kmalloc of %d bytes", size);
     }
-    memset(ptr, 0, size); // Initialize allocated memory to zero
+    return ptr; // Freshly mapped pages are already cleared
+}
+
+void* kmalloc_contiguous(size_t size, uintptr_t max_phys) {
+    size_t pages = PAGE_ALIGN(size) / PAGE_SIZE;
+    void* ptr = find_available_va(pages);
+    if (!alloc_contiguous_pages((uintptr_t)ptr, pages, max_phys, FLAGS_PRESENT | FLAGS_RW)) {
+        kfree(ptr);
+        return NULL;
+    }
+    memset(ptr, 0, size);
     return ptr;
 }
 
@@ -154,12 +358,19 @@ void* krealloc(void* ptr, size_t old_size, size_t new_size) {
 }
 
 void* alloc_region(uintptr_t vaddr, size_t size, uint64_t flags) {
-    for (uintptr_t i = vaddr; i < PAGE_ALIGN((vaddr + size)); i += PAGE_SIZE) {
+    uintptr_t end = PAGE_ALIGN((vaddr + size));
+    for (uintptr_t i = vaddr; i < end; ) {
+        // Use a 2 MiB page whenever an aligned 2 MiB chunk of the range is still unmapped
+        if (!(i & (HUGE_PAGE_SIZE - 1)) && end - i >= HUGE_PAGE_SIZE && alloc_huge_page(i, flags | FLAGS_PRESENT)) {
+            i += HUGE_PAGE_SIZE;
+            continue;
+        }
         // Allocate memory for the segment
         void* addr = alloc_page(i, flags | FLAGS_PRESENT);
         if (!addr) {
             return 0; // Memory allocation failed
         }
+        i += PAGE_SIZE;
     }
     return (void*)vaddr;
 }
@@ -178,8 +389,5 @@ void* alloc_mmio_region(uintptr_t vaddr, uintptr_t paddr, size_t size, uint64_t
 }
 
 void free_region(uintptr_t vaddr, size_t size) {
-    for (uintptr_t i = vaddr; i < PAGE_ALIGN((vaddr + size)); i += PAGE_SIZE) {
-        // Free the allocated memory for the segment
-        free_page((void*)i);
-    }
+    unmap_range(vaddr, size);
 }
@@ -1,16 +1,68 @@
 #include "paging.h"
 #include "mman.h"
 #include "../panic.h"
+#include "../cpu.h"
+#include "../smp.h"
 #include <stddef.h>
 #include <stdint.h>
 
-void* pml4_address = NULL;
 void* hhdm_base = 0;
 struct limine_memmap_response *memory_map = NULL;
-uint32_t* memory_bitmap = NULL;
-uintptr_t first_usable = 0;
+uint32_t* memory_bitmap = NULL; // Reference count of every physical frame
+uint8_t* frame_order = NULL;     // Order of the free block starting at a frame, or FRAME_NOT_FREE/FRAME_RESERVED
 uint64_t page_count = 0;
 
+// Buddy allocator free lists, linked through the free frames via the HHDM
+typedef struct FreeBlock {
+    struct FreeBlock* next;
+    struct FreeBlock* prev;
+} free_block_t;
+
+free_block_t* free_areas[BUDDY_MAX_ORDER + 1] = {0};
+uint64_t free_block_count[BUDDY_MAX_ORDER + 1] = {0};
+
+page_cache_t page_caches[MAX_CPUS] = {0};
+
+// Frames cleared ahead of time while the CPU is idle, and the frame every untouched
+// anonymous page maps read-only until it is first written
+static uintptr_t zero_pool[ZERO_POOL_SIZE];
+static int zero_pool_count = 0;
+uint64_t zero_pool_hits = 0;
+uint64_t zero_pool_misses = 0;
+uintptr_t zero_page = 0;
+
+// Address spaces keep their TLB entries across switches under a PCID. A PCID is only reused
+// without a flush by the address space that owns it, and only while no kernel mapping was
+// removed since, as kernel entries are cached separately under every PCID.
+//
+// Each CPU hands out its own PCIDs. A change to a mapping is only invalidated on the CPU
+// making it, the others catch up through generation counts: kernel_generation for the kernel
+// half, checked whenever a CPU takes the big kernel lock, and the generation of each address
+// space, checked when a CPU loads it. Until then the stale entries are unreachable, no CPU
+// runs kernel code without the lock and an address space is only in use by one task.
+// Address space generations are all drawn from mm_generations, so a PML4 frame reused by a
+// new address space never matches what a PCID was last flushed for under the old one.
+uint8_t pcid_enabled = 0;
+static uint64_t kernel_generation = 0;
+static uint64_t mm_generations = 0;
+static void* kernel_cr3 = NULL;
+
+typedef struct {
+    void* pml4; // HHDM pointer to the PML4 the paging functions work on
+    void* loaded_cr3;
+    uint16_t loaded_pcid;
+    uint16_t next_pcid;
+    uint16_t kernel_pcid; // For kernel_cr3 while idle
+    mm_counters_t* mm;
+    void* pcid_owner[PCID_COUNT];
+    uint64_t pcid_generation[PCID_COUNT];    // kernel_generation last flushed under the PCID
+    uint64_t pcid_mm_generation[PCID_COUNT]; // Generation of the owner last flushed under it
+} cpu_paging_t;
+
+static cpu_paging_t cpu_paging[MAX_CPUS];
+
+static void push_free_block(uintptr_t frame, unsigned order);
+
 #define HIGHER_LEVEL_FLAGS (FLAGS_PRESENT | FLAGS_RW | FLAGS_USER)
 
 uint64_t* add_hhdm_to(uint64_t* ptr) {
@@ -21,10 +73,14 @@ uint64_t* page_table_to_address(uint64_t entry) {
     return (uint64_t*)(entry & PAGE_MASK & ~FLAGS_NX);
 }
 
+uintptr_t huge_page_to_address(uint64_t entry) {
+    return entry & HUGE_PAGE_MASK & ~FLAGS_MASK;
+}
+
 uintptr_t get_physical_address(uintptr_t virtual_address) {
     page_address_t entry = get_page_entry(virtual_address);
 
-    uint64_t* pml4 = (uint64_t*)pml4_address;
+    uint64_t* pml4 = (uint64_t*)cpu_paging[cpu_id()].pml4;
     if (!(pml4[entry.pml4_index] & FLAGS_PRESENT)) return 0;
 
     uint64_t* pdpt = add_hhdm_to(page_table_to_address(pml4[entry.pml4_index]));
@@ -32,6 +88,9 @@ uintptr_t get_physical_address(uintptr_t virtual_address) {
 
     uint64_t* pd = add_hhdm_to(page_table_to_address(pdpt[entry.pdpt_index]));
     if (!(pd[entry.pd_index] & FLAGS_PRESENT)) return 0;
+    if (pd[entry.pd_index] & FLAGS_PSE) {
+        return huge_page_to_address(pd[entry.pd_index]) + (virtual_address & (HUGE_PAGE_SIZE - 1) & PAGE_MASK);
+    }
 
     uint64_t* pt = add_hhdm_to(page_table_to_address(pd[entry.pd_index]));
     if (!(pt[entry.pt_index] & FLAGS_PRESENT)) return 0;
@@ -42,7 +101,12 @@ uintptr_t get_physical_address(uintptr_t virtual_address) {
 void init_paging(uintptr_t cr3, struct limine_memmap_response *memmap, uintptr_t hhdm) {
     if (cr3 == 0 || memmap == NULL) panic("init_paging failed");
 
-    pml4_address = (void*)hhdm + cr3;
+    cr3 &= PAGE_MASK;
+    cpu_paging_t* cpu = &cpu_paging[cpu_id()];
+    cpu->pml4 = (void*)hhdm + cr3;
+    cpu->loaded_cr3 = (void*)cr3;
+    cpu->next_pcid = 1;
+    kernel_cr3 = (void*)cr3;
     hhdm_base = (void*)hhdm;
     memory_map = memmap;
 
@@ -56,7 +120,7 @@ void init_paging(uintptr_t cr3, struct limine_memmap_response *memmap, uintptr_t
     }
 
     page_count = highest / PAGE_SIZE;
-    size_t bitmap_size = page_count * 4;
+    size_t bitmap_size = page_count * sizeof(uint32_t) + page_count;
     uintptr_t bitmap_phys = 0;
 
     for (size_t i = 0; i < memmap->entry_count; i++) {
@@ -73,12 +137,15 @@ void init_paging(uintptr_t cr3, struct limine_memmap_response *memmap, uintptr_t
 
     if (!bitmap_phys) panic("Cannot allocate paging bitmap");
     memory_bitmap = (uint32_t*)add_hhdm_to((uint64_t*)bitmap_phys);
+    frame_order = (uint8_t*)(memory_bitmap + page_count);
 
     // Clear the bitmap and mark its pages as used
-    memset(memory_bitmap, 0, bitmap_size);
+    memset(memory_bitmap, 0, page_count * sizeof(uint32_t));
+    memset(frame_order, FRAME_NOT_FREE, page_count);
     for (uintptr_t addr = bitmap_phys; addr < bitmap_phys + bitmap_size; addr += PAGE_SIZE) {
         size_t page = addr / PAGE_SIZE;
         memory_bitmap[page] = 1;
+        frame_order[page] = FRAME_RESERVED;
     }
     // Mark reserved segments as used
     for (uintptr_t i = 0; i < memory_map->entry_count; i++) {
@@ -88,9 +155,61 @@ void init_paging(uintptr_t cr3, struct limine_memmap_response *memmap, uintptr_t
             uintptr_t end = (entry->base + entry->length) / PAGE_SIZE;
             for (uintptr_t j = start; j < end; j++) {
                 memory_bitmap[j] = 1;
+                frame_order[j] = FRAME_RESERVED;
             }
         }
     }
+    // Frame 0 is never handed out so that a physical address of 0 can mean failure
+    memory_bitmap[0] = 1;
+    frame_order[0] = FRAME_RESERVED;
+
+    // Hand every free run of usable frames to the buddy allocator in the largest aligned blocks possible
+    for (uintptr_t i = 0; i < memory_map->entry_count; i++) {
+        struct limine_memmap_entry *entry = memory_map->entries[i];
+        if (entry->type != LIMINE_MEMMAP_USABLE) continue;
+
+        uintptr_t frame = entry->base / PAGE_SIZE;
+        uintptr_t end = (entry->base + entry->length) / PAGE_SIZE;
+        while (frame < end) {
+            if (memory_bitmap[frame] != 0) {
+                frame++;
+                continue;
+            }
+            unsigned order = frame ? __builtin_ctzll(frame) : BUDDY_MAX_ORDER;
+            if (order > BUDDY_MAX_ORDER) order = BUDDY_MAX_ORDER;
+            while (frame + (1ULL << order) > end) order--;
+            for (uintptr_t j = frame; j < frame + (1ULL << order); j++) {
+                if (memory_bitmap[j] != 0) {
+                    order = 0;
+                    break;
+                }
+            }
+            push_free_block(frame, order);
+            frame += 1ULL << order;
+        }
+    }
+
+    // Make supervisor writes honour read-only PTEs so the kernel copying into a shared
+    // copy-on-write or page cache frame takes the CoW fault instead of writing through
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_WP) : "memory");
+
+    // Pinned with a reference that is never dropped, so it is never freed or written in place
+    zero_page = alloc_frame();
+    memset(add_hhdm_to((uint64_t*)zero_page), 0, PAGE_SIZE);
+    memory_bitmap[zero_page / PAGE_SIZE] = 1;
+
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    if (ecx & (1 << 17)) {
+        // CR3 must not carry PCD/PWT bits when PCIDE is turned on, the boot tables become PCID 0
+        asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+        uint64_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile("mov %0, %%cr4" :: "r"(cr4 | CR4_PCIDE) : "memory");
+        pcid_enabled = 1;
+    }
 }
 
 page_address_t get_page_entry(uintptr_t addr) {
@@ -104,138 +223,368 @@ page_address_t get_page_entry(uintptr_t addr) {
     return entry;
 }
 
-uintptr_t get_available_address() {
-    for (uintptr_t i = first_usable; i < page_count; i++) {
-        if (memory_bitmap[i] == 0) {
-            first_usable = i + 1;
-            return i * PAGE_SIZE;
+static void push_free_block(uintptr_t frame, unsigned order) {
+    free_block_t* block = (free_block_t*)add_hhdm_to((uint64_t*)(frame * PAGE_SIZE));
+    block->prev = NULL;
+    block->next = free_areas[order];
+    if (free_areas[order]) free_areas[order]->prev = block;
+    free_areas[order] = block;
+    free_block_count[order]++;
+    frame_order[frame] = order;
+}
+
+static void remove_free_block(uintptr_t frame, unsigned order) {
+    free_block_t* block = (free_block_t*)add_hhdm_to((uint64_t*)(frame * PAGE_SIZE));
+    if (block->prev) block->prev->next = block->next;
+    else free_areas[order] = block->next;
+    if (block->next) block->next->prev = block->prev;
+    free_block_count[order]--;
+    frame_order[frame] = FRAME_NOT_FREE;
+}
+
+static uintptr_t block_frame(free_block_t* block) {
+    return ((uintptr_t)block - (uintptr_t)hhdm_base) / PAGE_SIZE;
+}
+
+uintptr_t alloc_frames(unsigned order, uintptr_t max_phys) {
+    for (unsigned o = order; o <= BUDDY_MAX_ORDER; o++) {
+        free_block_t* block = free_areas[o];
+        if (max_phys) {
+            while (block && (block_frame(block) + (1ULL << order)) * PAGE_SIZE > max_phys) {
+                block = block->next;
+            }
         }
+        if (!block) continue;
+
+        uintptr_t frame = block_frame(block);
+        remove_free_block(frame, o);
+        // Split off the upper halves until the block has the requested size
+        while (o > order) {
+            o--;
+            push_free_block(frame + (1ULL << o), o);
+        }
+        return frame * PAGE_SIZE;
     }
-    panic("Out of memory: No available address found");
+    return 0;
+}
+
+void free_frames(uintptr_t phys, unsigned order) {
+    uintptr_t frame = phys / PAGE_SIZE;
+    while (order < BUDDY_MAX_ORDER) {
+        uintptr_t buddy = frame ^ (1ULL << order);
+        if (buddy >= page_count || frame_order[buddy] != order) break;
+        remove_free_block(buddy, order);
+        if (buddy < frame) frame = buddy;
+        order++;
+    }
+    push_free_block(frame, order);
+}
+
+// Single frames go through a small per-CPU cache that is refilled from and
+// flushed to the buddy allocator in batches
+uintptr_t alloc_frame() {
+    uint64_t flags = irq_save();
+    page_cache_t* cache = &page_caches[cpu_id()];
+    if (cache->count == 0) {
+        cache->misses++;
+        while (cache->count < PAGE_CACHE_BATCH) {
+            uintptr_t phys = alloc_frames(0, 0);
+            if (!phys) break;
+            cache->frames[cache->count++] = phys;
+        }
+        if (cache->count == 0) {
+            // Last resort, the frames cleared in advance
+            uintptr_t phys = zero_pool_count ? zero_pool[--zero_pool_count] : 0;
+            irq_restore(flags);
+            return phys;
+        }
+    } else {
+        cache->hits++;
+    }
+    uintptr_t phys = cache->frames[--cache->count];
+    irq_restore(flags);
+    return phys;
+}
+
+void free_frame(uintptr_t phys) {
+    uint64_t flags = irq_save();
+    page_cache_t* cache = &page_caches[cpu_id()];
+    if (cache->count == PAGE_CACHE_SIZE) {
+        cache->flushes++;
+        while (cache->count > PAGE_CACHE_SIZE - PAGE_CACHE_BATCH) {
+            free_frames(cache->frames[--cache->count], 0);
+        }
+    }
+    cache->frames[cache->count++] = phys;
+    irq_restore(flags);
+}
+
+// A cleared frame, taken from the pool when possible so the clearing is off the hot path
+uintptr_t alloc_zeroed_frame() {
+    uint64_t flags = irq_save();
+    if (zero_pool_count) {
+        uintptr_t phys = zero_pool[--zero_pool_count];
+        zero_pool_hits++;
+        irq_restore(flags);
+        return phys;
+    }
+    zero_pool_misses++;
+    irq_restore(flags);
+
+    uintptr_t phys = alloc_frame();
+    if (phys) memset(add_hhdm_to((uint64_t*)phys), 0, PAGE_SIZE);
+    return phys;
+}
+
+// Clear up to count frames into the pool. Returns 1 once the pool is full or memory runs out.
+// The frames are cleared with the lock dropped, nothing else can see them before they are
+// added to the pool.
+int refill_zero_pool(int count) {
+    for (int i = 0; i < count; i++) {
+        if (zero_pool_count >= ZERO_POOL_SIZE) return 1;
+        uintptr_t phys = alloc_frame();
+        if (!phys) return 1;
+        int depth = kernel_suspend();
+        memset(add_hhdm_to((uint64_t*)phys), 0, PAGE_SIZE);
+        kernel_resume(depth);
+
+        uint64_t flags = irq_save();
+        if (zero_pool_count < ZERO_POOL_SIZE) {
+            zero_pool[zero_pool_count++] = phys;
+            phys = 0;
+        }
+        irq_restore(flags);
+        if (phys) free_frame(phys); // Filled up by another CPU or an interrupt meanwhile
+    }
+    return zero_pool_count >= ZERO_POOL_SIZE;
+}
+
+// Drop one reference to a frame and return it to the allocator once unused
+static void put_frame(size_t page_index) {
+    if (memory_bitmap[page_index] == 0) return;
+    if (--memory_bitmap[page_index] == 0 && frame_order[page_index] != FRAME_RESERVED) {
+        free_frame(page_index * PAGE_SIZE);
+    }
+}
+
+void ref_frame(uintptr_t phys) {
+    memory_bitmap[phys / PAGE_SIZE]++;
+}
+
+void unref_frame(uintptr_t phys) {
+    put_frame(phys / PAGE_SIZE);
+}
+
+uint32_t frame_refcount(uintptr_t phys) {
+    return memory_bitmap[phys / PAGE_SIZE];
+}
+
+uintptr_t get_available_address() {
+    uintptr_t phys = alloc_frame();
+    if (!phys) panic("Out of memory: No available address found");
+    return phys;
 }
 
 void* allocate_page_table() {
-    uintptr_t addr = get_available_address();
+    uintptr_t addr = alloc_zeroed_frame();
+    if (!addr) panic("Out of memory: No available address found");
     size_t page = addr / PAGE_SIZE;
     memory_bitmap[page]++;
-
-    memset(add_hhdm_to((uint64_t*)addr), 0, PAGE_SIZE);
     return (void*)addr;
 }
 
+// Charge user pages mapped into, or with a negative count unmapped from, the current address space
+void account_user_pages(uintptr_t vaddr, int64_t pages) {
+    mm_counters_t* mm = cpu_paging[cpu_id()].mm;
+    if (vaddr < KERNEL_HALF && mm) mm->resident += pages;
+}
+
+// Whether mapping new_pages more pages would take the current address space past its limit
+int over_memory_limit(uint64_t new_pages) {
+    mm_counters_t* mm = cpu_paging[cpu_id()].mm;
+    if (mm == NULL || mm->limit == 0) return 0;
+    return mm->resident + new_pages > mm->limit;
+}
+
+// After fork() the two address spaces share their lower-half page tables. An entry that
+// points at a shared table has RW cleared and FLAGS_COW set, the reference count of the
+// table frame counts the address spaces using it, and the table is only copied once one
+// of them changes a mapping below it.
+uint64_t unshared_tables = 0;
+
+// Called after invalidating a mapping in the current PCID, the other PCIDs of this CPU and
+// the other CPUs are flushed when they next load the address space or take the lock
+static void mapping_changed(uintptr_t vaddr) {
+    cpu_paging_t* cpu = &cpu_paging[cpu_id()];
+    if (vaddr >= KERNEL_HALF) {
+        kernel_generation++;
+        cpu->pcid_generation[cpu->loaded_pcid] = kernel_generation;
+    } else if (cpu->mm) {
+        cpu->mm->tlb_generation = ++mm_generations;
+        cpu->pcid_mm_generation[cpu->loaded_pcid] = cpu->mm->tlb_generation;
+    }
+}
+
+static void flush_tlb() {
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile("mov %0, %%cr3" ::"r"(cr3) : "memory");
+}
+
+// Make the table below entry private to the current address space. level is the level of
+// that table: 3 for a PDPT, 2 for a PD and 1 for a PT.
+static uint64_t* unshare_table(uint64_t* entry, int level) {
+    uint64_t e = *entry;
+    uintptr_t table = (uintptr_t)page_table_to_address(e);
+    if (!(e & FLAGS_COW)) return add_hhdm_to((uint64_t*)table);
+
+    if (memory_bitmap[table / PAGE_SIZE] > 1) {
+        uint64_t* old_table = add_hhdm_to((uint64_t*)table);
+        uintptr_t copy = (uintptr_t)allocate_page_table();
+        uint64_t* new_table = add_hhdm_to((uint64_t*)copy);
+
+        // Whatever the old table points to gains a user, and becomes copy-on-write for both
+        for (int i = 0; i < 512; i++) {
+            uint64_t child = old_table[i];
+            if (!(child & FLAGS_PRESENT)) continue;
+            if (level > 1 && (child & FLAGS_PSE)) {
+                size_t first = huge_page_to_address(child) / PAGE_SIZE;
+                for (size_t j = 0; j < HUGE_PAGE_SIZE / PAGE_SIZE; j++) memory_bitmap[first + j]++;
+            } else {
+                memory_bitmap[(uintptr_t)page_table_to_address(child) / PAGE_SIZE]++;
+            }
+            int is_table = level > 1 && !(child & FLAGS_PSE); // Shared in turn
+            if (is_table || (child & FLAGS_RW)) child = (child & ~FLAGS_RW) | FLAGS_COW;
+            old_table[i] = child;
+            new_table[i] = child;
+        }
+        memory_bitmap[table / PAGE_SIZE]--;
+        table = copy;
+    }
+    *entry = table | (e & FLAGS_MASK & ~FLAGS_COW) | FLAGS_RW;
+    unshared_tables++;
+    flush_tlb(); // Other entries below this one may be cached read-only
+    mapping_changed(0);
+    return add_hhdm_to((uint64_t*)table);
+}
+
+// Follow entry down to the next level, creating the table if it is missing and create is set
+static uint64_t* next_table(uint64_t* entry, int level, uint64_t flags, int create) {
+    if (!(*entry & FLAGS_PRESENT)) {
+        if (!create) return NULL;
+        // Intermediate levels stay writable, the leaf entries carry the real permissions
+        *entry = (uintptr_t)allocate_page_table() | FLAGS_PRESENT | FLAGS_RW | (flags & FLAGS_USER);
+    }
+    return unshare_table(entry, level);
+}
+
+// Page directory covering vaddr in the current address space, with every table above it private
+static uint64_t* walk_to_pd(uintptr_t vaddr, uint64_t flags, int create, uint64_t** pdpt_out) {
+    page_address_t idx = get_page_entry(vaddr);
+    uint64_t* pml4 = (uint64_t*)cpu_paging[cpu_id()].pml4;
+
+    uint64_t* pdpt = next_table(&pml4[idx.pml4_index], 3, flags, create);
+    if (!pdpt) return NULL;
+    if (pdpt_out) *pdpt_out = pdpt;
+    return next_table(&pdpt[idx.pdpt_index], 2, flags, create);
+}
+
+// Replace the 2 MiB mapping in pd[index] with a page table of 512 equivalent 4 KiB entries
+static uint64_t* split_huge_page(uint64_t* pd, int index, uintptr_t vaddr) {
+    uint64_t pde = pd[index];
+    uintptr_t phys = huge_page_to_address(pde);
+    uint64_t flags = pde & FLAGS_MASK & ~FLAGS_PSE & ~FLAGS_PAT;
+
+    uint64_t* new_pt = allocate_page_table();
+    uint64_t* pt = add_hhdm_to(new_pt);
+    for (int i = 0; i < 512; i++) {
+        pt[i] = (phys + i * PAGE_SIZE) | flags;
+    }
+    // The page table entries carry the real permissions
+    pd[index] = (uintptr_t)new_pt | FLAGS_PRESENT | FLAGS_RW | (pde & FLAGS_USER);
+    asm volatile("invlpg (%0)" ::"r"(vaddr & ~(HUGE_PAGE_SIZE - 1)) : "memory");
+    mapping_changed(vaddr);
+    return pt;
+}
+
+// Page table covering vaddr, a huge page in the way is split into 4 KiB pages
+static uint64_t* walk_to_pt(uint64_t* pd, uintptr_t vaddr, uint64_t flags, int create) {
+    page_address_t idx = get_page_entry(vaddr);
+    if (pd == NULL) return NULL;
+    if ((pd[idx.pd_index] & FLAGS_PRESENT) && (pd[idx.pd_index] & FLAGS_PSE)) {
+        return split_huge_page(pd, idx.pd_index, vaddr);
+    }
+    return next_table(&pd[idx.pd_index], 1, flags, create);
+}
+
 void* alloc_page(uintptr_t vaddr, uint64_t flags) {
     page_address_t idx = get_page_entry(vaddr);
-    uint64_t *pml4 = (uint64_t*)pml4_address;
-
-    // --- PML4 level ---
-    uint64_t pml4e = pml4[idx.pml4_index];
-    if (!(pml4e & FLAGS_PRESENT)) {
-        uint64_t *new_pdpt = allocate_page_table();
-        uint64_t *new_pdpt_hhdm = add_hhdm_to(new_pdpt);
-        if (!new_pdpt) panic("alloc_page: cannot allocate PDPT");
-        // clear entries
-        for (int i = 0; i < 512; i++) new_pdpt_hhdm[i] = 0;
-        // install
-        pml4[idx.pml4_index] = ((uintptr_t)new_pdpt & PAGE_MASK)
-                              | (flags & HIGHER_LEVEL_FLAGS)
-                              | FLAGS_PRESENT;
-        pml4e = pml4[idx.pml4_index];
-    }
-    uint64_t *pdpt = add_hhdm_to(page_table_to_address(pml4e));
-
-    // --- PDPT level ---
-    uint64_t pdpte = pdpt[idx.pdpt_index];
-    if (!(pdpte & FLAGS_PRESENT)) {
-        uint64_t *new_pd = allocate_page_table();
-        uint64_t *new_pd_hhdm = add_hhdm_to(new_pd);
-        if (!new_pd) panic("alloc_page: cannot allocate PD");
-        for (int i = 0; i < 512; i++) new_pd_hhdm[i] = 0;
-        pdpt[idx.pdpt_index] = ((uintptr_t)new_pd & PAGE_MASK)
-                              | (flags & HIGHER_LEVEL_FLAGS)
-                              | FLAGS_PRESENT;
-        pdpte = pdpt[idx.pdpt_index];
-    }
-    uint64_t *pd = add_hhdm_to(page_table_to_address(pdpte));
-
-    // --- PD level ---
-    uint64_t pde = pd[idx.pd_index];
-    if (!(pde & FLAGS_PRESENT)) {
-        uint64_t *new_pt = allocate_page_table();
-        uint64_t *new_pt_hhdm = add_hhdm_to(new_pt);
-        if (!new_pt) panic("alloc_page: cannot allocate PT");
-        for (int i = 0; i < 512; i++) new_pt_hhdm[i] = 0;
-        pd[idx.pd_index] = ((uintptr_t)new_pt & PAGE_MASK)
-                          | (flags & HIGHER_LEVEL_FLAGS)
-                          | FLAGS_PRESENT;
-        pde = pd[idx.pd_index];
-    }
-    uint64_t *pt = add_hhdm_to(page_table_to_address(pde));
-
-    // --- PT level ---
+    uint64_t* pd = walk_to_pd(vaddr, flags, 1, NULL);
+    if (pd[idx.pd_index] & FLAGS_PSE) {
+        panic("alloc_page: virtual 0x%p is inside a huge page", (void*)vaddr);
+    }
+    uint64_t* pt = walk_to_pt(pd, vaddr, flags, 1);
+
     if (pt[idx.pt_index] & FLAGS_PRESENT) {
         panic("alloc_page: virtual 0x%p already mapped", (void*)vaddr);
     }
 
-    // allocate a physical page and map it
-    uintptr_t phys = get_available_address();
+    // Allocate a cleared physical page and map it, nothing of the frame's previous user leaks
+    uintptr_t phys = alloc_zeroed_frame();
+    if (!phys) panic("Out of memory: No available address found");
     pt[idx.pt_index] = (phys & PAGE_MASK)
                       | flags
                       | FLAGS_PRESENT;
     size_t page = phys / PAGE_SIZE;
     memory_bitmap[page]++;
+    account_user_pages(vaddr, 1);
+
+    return (void*)vaddr;
+}
+
+// Map a frame that is already in use elsewhere, taking another reference on it
+void* map_frame(uintptr_t vaddr, uintptr_t phys, uint64_t flags) {
+    if (!alloc_mmio_page(vaddr, phys, flags)) return NULL;
+    ref_frame(phys);
+    return (void*)vaddr;
+}
+
+// alloc_page() frames are always cleared, kept for callers that rely on it explicitly
+void* alloc_zeroed_page(uintptr_t vaddr, uint64_t flags) {
+    return alloc_page(vaddr, flags);
+}
+
+void* alloc_huge_page(uintptr_t vaddr, uint64_t flags) {
+    if (vaddr & (HUGE_PAGE_SIZE - 1)) return NULL;
+    page_address_t idx = get_page_entry(vaddr);
+    uint64_t* pd = walk_to_pd(vaddr, flags, 1, NULL);
+
+    if (pd[idx.pd_index] & FLAGS_PRESENT) {
+        return NULL; // Part of the range already uses 4 KiB pages
+    }
+
+    uintptr_t phys = alloc_frames(HUGE_PAGE_ORDER, 0);
+    if (!phys) return NULL; // No contiguous 2 MiB block left, caller falls back to 4 KiB pages
+
+    // Every 4 KiB frame keeps its own reference count so the page can be split later
+    for (size_t i = 0; i < HUGE_PAGE_SIZE / PAGE_SIZE; i++) {
+        memory_bitmap[phys / PAGE_SIZE + i] = 1;
+    }
+    memset(add_hhdm_to((uint64_t*)phys), 0, HUGE_PAGE_SIZE);
+    pd[idx.pd_index] = phys | flags | FLAGS_PSE | FLAGS_PRESENT;
+    account_user_pages(vaddr, HUGE_PAGE_SIZE / PAGE_SIZE);
 
     return (void*)vaddr;
 }
 
 void* alloc_mmio_page(uintptr_t vaddr, uintptr_t paddr, uint64_t flags) {
     page_address_t idx = get_page_entry(vaddr);
-    uint64_t *pml4 = (uint64_t*)pml4_address;
-
-    // --- PML4 level ---
-    uint64_t pml4e = pml4[idx.pml4_index];
-    if (!(pml4e & FLAGS_PRESENT)) {
-        uint64_t *new_pdpt = allocate_page_table();
-        uint64_t *new_pdpt_hhdm = add_hhdm_to(new_pdpt);
-        if (!new_pdpt) panic("alloc_page: cannot allocate PDPT");
-        // clear entries
-        for (int i = 0; i < 512; i++) new_pdpt_hhdm[i] = 0;
-        // install
-        pml4[idx.pml4_index] = ((uintptr_t)new_pdpt & PAGE_MASK)
-                              | (flags & HIGHER_LEVEL_FLAGS)
-                              | FLAGS_PRESENT;
-        pml4e = pml4[idx.pml4_index];
-    }
-    uint64_t *pdpt = add_hhdm_to(page_table_to_address(pml4e));
-
-    // --- PDPT level ---
-    uint64_t pdpte = pdpt[idx.pdpt_index];
-    if (!(pdpte & FLAGS_PRESENT)) {
-        uint64_t *new_pd = allocate_page_table();
-        uint64_t *new_pd_hhdm = add_hhdm_to(new_pd);
-        if (!new_pd) panic("alloc_page: cannot allocate PD");
-        for (int i = 0; i < 512; i++) new_pd_hhdm[i] = 0;
-        pdpt[idx.pdpt_index] = ((uintptr_t)new_pd & PAGE_MASK)
-                              | (flags & HIGHER_LEVEL_FLAGS)
-                              | FLAGS_PRESENT;
-        pdpte = pdpt[idx.pdpt_index];
-    }
-    uint64_t *pd = add_hhdm_to(page_table_to_address(pdpte));
-
-    // --- PD level ---
-    uint64_t pde = pd[idx.pd_index];
-    if (!(pde & FLAGS_PRESENT)) {
-        uint64_t *new_pt = allocate_page_table();
-        uint64_t *new_pt_hhdm = add_hhdm_to(new_pt);
-        if (!new_pt) panic("alloc_page: cannot allocate PT");
-        for (int i = 0; i < 512; i++) new_pt_hhdm[i] = 0;
-        pd[idx.pd_index] = ((uintptr_t)new_pt & PAGE_MASK)
-                          | (flags & HIGHER_LEVEL_FLAGS)
-                          | FLAGS_PRESENT;
-        pde = pd[idx.pd_index];
-    }
-    uint64_t *pt = add_hhdm_to(page_table_to_address(pde));
-
-    // --- PT level ---
+    uint64_t* pd = walk_to_pd(vaddr, flags, 1, NULL);
+    if (pd[idx.pd_index] & FLAGS_PSE) {
+        panic("alloc_mmio_page: virtual 0x%p is inside a huge page", (void*)vaddr);
+    }
+    uint64_t* pt = walk_to_pt(pd, vaddr, flags, 1);
+
     if (pt[idx.pt_index] & FLAGS_PRESENT) {
         panic("alloc_page: virtual 0x%p already mapped", (void*)vaddr);
     }
@@ -243,99 +592,245 @@ void* alloc_mmio_page(uintptr_t vaddr, uintptr_t paddr, uint64_t flags) {
     pt[idx.pt_index] = (paddr & PAGE_MASK)
                       | flags
                       | FLAGS_PRESENT;
+    account_user_pages(vaddr, 1);
 
     return (void*)vaddr;
 }
 
-int free_page(void *page) {
-    if (page == NULL) {
-        return -1; // Nothing to free
+void* alloc_contiguous_pages(uintptr_t vaddr, size_t pages, uintptr_t max_phys, uint64_t flags) {
+    unsigned order = 0;
+    while ((1ULL << order) < pages) order++;
+    if (order > BUDDY_MAX_ORDER) return NULL;
+
+    uintptr_t phys = alloc_frames(order, max_phys);
+    if (!phys) return NULL;
+
+    for (size_t i = 0; i < pages; i++) {
+        alloc_mmio_page(vaddr + i * PAGE_SIZE, phys + i * PAGE_SIZE, flags | FLAGS_PRESENT);
+        memory_bitmap[phys / PAGE_SIZE + i] = 1;
+    }
+    // Give back the tail of the power-of-two block that was not needed
+    for (size_t i = pages; i < (1ULL << order); i++) {
+        free_frames(phys + i * PAGE_SIZE, 0);
+    }
+    return (void*)vaddr;
+}
+
+void tlb_batch_init(tlb_batch_t* batch) {
+    batch->page_count = 0;
+    batch->frame_count = 0;
+    batch->kernel = 0;
+    batch->user = 0;
+}
+
+void tlb_batch_add(tlb_batch_t* batch, uintptr_t vaddr) {
+    if (batch->page_count < TLB_BATCH_PAGES) batch->pages[batch->page_count] = vaddr;
+    batch->page_count++;
+    if (vaddr >= KERNEL_HALF) {
+        batch->kernel = 1;
+    } else {
+        batch->user = 1;
     }
+}
 
-    uintptr_t address = (uintptr_t)page;
-    page_address_t entry = get_page_entry(address);
+// Frames unmapped by the batch are only freed once no TLB can reach them anymore
+static void tlb_batch_put_frame(tlb_batch_t* batch, size_t page_index) {
+    if (batch->frame_count == TLB_BATCH_FRAMES) tlb_batch_flush(batch);
+    batch->frames[batch->frame_count++] = page_index;
+}
 
-    uint64_t* pml4 = (uint64_t*)pml4_address;
-    if (!(pml4[entry.pml4_index] & FLAGS_PRESENT)) {
-        return -1; // PML4 entry not present
+void tlb_batch_flush(tlb_batch_t* batch) {
+    if (batch->page_count > TLB_BATCH_PAGES) {
+        flush_tlb();
+    } else {
+        for (size_t i = 0; i < batch->page_count; i++) {
+            asm volatile("invlpg (%0)" ::"r"(batch->pages[i]) : "memory");
+        }
     }
+    if (batch->kernel) mapping_changed(KERNEL_HALF);
+    if (batch->user) mapping_changed(0);
+    for (size_t i = 0; i < batch->frame_count; i++) put_frame(batch->frames[i]);
+    tlb_batch_init(batch);
+}
 
-    uint64_t* pdpt = add_hhdm_to(page_table_to_address(pml4[entry.pml4_index]));
-    if (!(pdpt[entry.pdpt_index] & FLAGS_PRESENT)) {
-        return -1; // PDPT entry not present
+// Free the PD and PDPT above an entry that was just cleared if they became empty. The kernel
+// half PDPTs stay, every address space has its own copy of the PML4 entries pointing to them.
+static void reclaim_page_tables(uint64_t* pml4, uint64_t* pdpt, uint64_t* pd, page_address_t entry, tlb_batch_t* batch) {
+    for (int i = 0; i < 512; i++) {
+        if (pd[i] & FLAGS_PRESENT) return;
     }
+    tlb_batch_put_frame(batch, (uint64_t)page_table_to_address(pdpt[entry.pdpt_index]) / PAGE_SIZE);
+    pdpt[entry.pdpt_index] = 0;
 
-    uint64_t* pd = add_hhdm_to(page_table_to_address(pdpt[entry.pdpt_index]));
-    if (!(pd[entry.pd_index] & FLAGS_PRESENT)) {
-        return -1; // PD entry not present
+    if (entry.pml4_index >= 256) return;
+    for (int i = 0; i < 512; i++) {
+        if (pdpt[i] & FLAGS_PRESENT) return;
     }
+    tlb_batch_put_frame(batch, (uint64_t)page_table_to_address(pml4[entry.pml4_index]) / PAGE_SIZE);
+    pml4[entry.pml4_index] = 0;
+}
 
-    uint64_t* pt = add_hhdm_to(page_table_to_address(pd[entry.pd_index]));
+// Unmap one 4 KiB page, its invalidation and the frames it releases are queued on batch
+static int unmap_page(uintptr_t address, tlb_batch_t* batch) {
+    page_address_t entry = get_page_entry(address);
+
+    uint64_t* pml4 = (uint64_t*)cpu_paging[cpu_id()].pml4;
+    uint64_t* pdpt;
+    uint64_t* pd = walk_to_pd(address, 0, 0, &pdpt);
+    if (pd == NULL || !(pd[entry.pd_index] & FLAGS_PRESENT)) {
+        return -1; // Not mapped
+    }
+
+    uint64_t* pt = walk_to_pt(pd, address, 0, 0); // Only this 4 KiB page goes away from a huge page
     if (!(pt[entry.pt_index] & FLAGS_PRESENT)) {
         return -1; // PT entry not present
     }
 
-    // Free the page and clear the entry
-    uintptr_t phys = pt[entry.pt_index] & PAGE_MASK;
+    uintptr_t phys = (uintptr_t)page_table_to_address(pt[entry.pt_index]);
     pt[entry.pt_index] = 0;
-
-    // Invalidate the TLB for the virtual address
-    asm volatile("invlpg (%0)" ::"r"(page) : "memory");
-
-    // Remove allocation from bitmap
-    size_t page_index = phys / PAGE_SIZE;
-    if (memory_bitmap[page_index] > 0) memory_bitmap[page_index]--;
-    if (memory_bitmap[page_index] == 0 && page_index < first_usable) first_usable = page_index;
+    if (phys != zero_page) account_user_pages(address, -1); // The zero page is never charged
+    tlb_batch_add(batch, address);
+    tlb_batch_put_frame(batch, phys / PAGE_SIZE);
 
     // Check if the PT, PD, or PDPT can be freed
-    int empty = 1;
     for (int i = 0; i < 512; i++) {
-        if (pt[i] & FLAGS_PRESENT) {
-            empty = 0;
-            break;
-        }
+        if (pt[i] & FLAGS_PRESENT) return 0;
     }
-    if (empty) {
-        size_t page_index = (uint64_t)page_table_to_address(pd[entry.pd_index]) / PAGE_SIZE;
-        if (memory_bitmap[page_index] > 0) memory_bitmap[page_index]--;
-        if (memory_bitmap[page_index] == 0 && page_index < first_usable) first_usable = page_index;
-        pd[entry.pd_index] = 0;
-        asm volatile("invlpg (%0)" ::"r"(pd) : "memory");
+    tlb_batch_put_frame(batch, (uint64_t)page_table_to_address(pd[entry.pd_index]) / PAGE_SIZE);
+    pd[entry.pd_index] = 0;
+    reclaim_page_tables(pml4, pdpt, pd, entry, batch);
+    return 0;
+}
+
+int free_page(void *page) {
+    if (page == NULL) {
+        return -1; // Nothing to free
     }
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+    int result = unmap_page((uintptr_t)page, &batch);
+    tlb_batch_flush(&batch);
+    return result;
+}
 
-    empty = 1;
-    for (int i = 0; i < 512; i++) {
-        if (pd[i] & FLAGS_PRESENT) {
-            empty = 0;
-            break;
+// Unmap and free everything mapped in [vaddr, vaddr + size) with a single TLB flush at the end
+void unmap_range(uintptr_t vaddr, size_t size) {
+    uintptr_t end = PAGE_ALIGN(vaddr + size);
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+
+    for (uintptr_t i = vaddr & PAGE_MASK; i < end; ) {
+        page_address_t entry = get_page_entry(i);
+        uint64_t* pd = walk_to_pd(i, 0, 0, NULL);
+        uintptr_t next_huge = (i + HUGE_PAGE_SIZE) & HUGE_PAGE_MASK;
+        if (pd == NULL || !(pd[entry.pd_index] & FLAGS_PRESENT)) {
+            if (next_huge <= i) break; // Wrapped past the top of the address space
+            i = next_huge;
+            continue;
+        }
+        uint64_t pde = pd[entry.pd_index];
+        // Whole huge pages go back to the buddy allocator in one piece
+        if ((pde & FLAGS_PSE) && !(i & (HUGE_PAGE_SIZE - 1)) && end - i >= HUGE_PAGE_SIZE) {
+            free_huge_page((void*)i);
+            i = next_huge;
+            continue;
         }
+        unmap_page(i, &batch);
+        i += PAGE_SIZE;
     }
-    if (empty) {
-        size_t page_index = (uint64_t)page_table_to_address(pdpt[entry.pdpt_index]) / PAGE_SIZE;
-        if (memory_bitmap[page_index] > 0) memory_bitmap[page_index]--;
-        if (memory_bitmap[page_index] == 0 && page_index < first_usable) first_usable = page_index;
-        pdpt[entry.pdpt_index] = 0;
-        asm volatile("invlpg (%0)" ::"r"(pdpt) : "memory");
+    tlb_batch_flush(&batch);
+}
+
+static int change_page_flags(uintptr_t vaddr, uint64_t flags, tlb_batch_t* batch) {
+    page_address_t entry = get_page_entry(vaddr);
+
+    uint64_t* pd = walk_to_pd(vaddr, 0, 0, NULL);
+    if (pd == NULL || !(pd[entry.pd_index] & FLAGS_PRESENT)) return -1;
+    uint64_t* pt = walk_to_pt(pd, vaddr, 0, 0);
+    if (!(pt[entry.pt_index] & FLAGS_PRESENT)) return -1;
+
+    uintptr_t phys = (uintptr_t)page_table_to_address(pt[entry.pt_index]);
+    flags = (flags & FLAGS_MASK & ~FLAGS_COW) | FLAGS_PRESENT;
+    if ((flags & FLAGS_RW) && memory_bitmap[phys / PAGE_SIZE] > 1) {
+        flags = (flags & ~FLAGS_RW) | FLAGS_COW;
+    }
+    pt[entry.pt_index] = phys | flags;
+    tlb_batch_add(batch, vaddr);
+    return 0;
+}
+
+// Change the protection of a mapped 4 KiB page. A shared frame that becomes writable is
+// marked copy-on-write instead, and dropping write access also drops copy-on-write.
+int set_page_flags(uintptr_t vaddr, uint64_t flags) {
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+    int result = change_page_flags(vaddr, flags, &batch);
+    tlb_batch_flush(&batch);
+    return result;
+}
+
+// set_page_flags() for every page mapped in [vaddr, vaddr + size), flushed once
+void protect_range(uintptr_t vaddr, size_t size, uint64_t flags) {
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+    for (uintptr_t page = vaddr & PAGE_MASK; page < vaddr + size; page += PAGE_SIZE) {
+        change_page_flags(page, flags, &batch);
     }
+    tlb_batch_flush(&batch);
+}
 
-    empty = 1;
-    for (int i = 0; i < 512; i++) {
-        if (pdpt[i] & FLAGS_PRESENT) {
-            empty = 0;
+int free_huge_page(void* page) {
+    uintptr_t address = (uintptr_t)page;
+    if (address & (HUGE_PAGE_SIZE - 1)) return -1;
+    page_address_t entry = get_page_entry(address);
+
+    uint64_t* pml4 = (uint64_t*)cpu_paging[cpu_id()].pml4;
+    uint64_t* pdpt;
+    uint64_t* pd = walk_to_pd(address, 0, 0, &pdpt);
+    if (pd == NULL) return -1;
+    uint64_t pde = pd[entry.pd_index];
+    if (!(pde & FLAGS_PRESENT) || !(pde & FLAGS_PSE)) return -1;
+
+    pd[entry.pd_index] = 0;
+    asm volatile("invlpg (%0)" ::"r"(page) : "memory");
+    mapping_changed(address);
+    account_user_pages(address, -(int64_t)(HUGE_PAGE_SIZE / PAGE_SIZE));
+
+    size_t first = huge_page_to_address(pde) / PAGE_SIZE;
+    int exclusive = 1;
+    for (size_t i = 0; i < HUGE_PAGE_SIZE / PAGE_SIZE; i++) {
+        if (memory_bitmap[first + i] != 1) {
+            exclusive = 0;
             break;
         }
     }
-    if (empty) {
-        size_t page_index = (uint64_t)page_table_to_address(pml4[entry.pml4_index]) / PAGE_SIZE;
-        if (memory_bitmap[page_index] > 0) memory_bitmap[page_index]--;
-        if (memory_bitmap[page_index] == 0 && page_index < first_usable) first_usable = page_index;
-        pml4[entry.pml4_index] = 0;
-        asm volatile("invlpg (%0)" ::"r"(pml4) : "memory");
+    if (exclusive) {
+        // Hand the block back whole instead of as 512 single frames
+        for (size_t i = 0; i < HUGE_PAGE_SIZE / PAGE_SIZE; i++) memory_bitmap[first + i] = 0;
+        free_frames(first * PAGE_SIZE, HUGE_PAGE_ORDER);
+    } else {
+        for (size_t i = 0; i < HUGE_PAGE_SIZE / PAGE_SIZE; i++) put_frame(first + i);
     }
 
-    return 0; // Success
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+    reclaim_page_tables(pml4, pdpt, pd, entry, &batch);
+    tlb_batch_flush(&batch);
+    return 0;
+}
+
+// An address space with an empty lower half, the kernel half is the same in every one
+void* create_address_space() {
+    uint64_t* new_pml4 = allocate_page_table();
+    uint64_t* current = (uint64_t*)cpu_paging[cpu_id()].pml4;
+    for (int i = 256; i < 512; i++) {
+        add_hhdm_to(new_pml4)[i] = current[i];
+    }
+    return new_pml4;
 }
 
+// Only the PML4 is copied, the lower-half tables below it become shared copy-on-write
+// and are copied level by level when either side first changes them
 void* clone_page_tables(void* pml4_address) {
     uint64_t* new_pml4 = allocate_page_table();
     uint64_t* old_pml4 = add_hhdm_to(pml4_address);
@@ -350,137 +845,224 @@ void* clone_page_tables(void* pml4_address) {
         }
 
         if (pml4e & FLAGS_PRESENT) {
-            uint64_t* pdpt = add_hhdm_to(page_table_to_address(pml4e));
-            uint64_t* new_pdpt = allocate_page_table();
-
-            for (int j = 0; j < 512; j++) {
-                uint64_t pdpte = pdpt[j];
-                if (pdpte & FLAGS_PRESENT) {
-                    uint64_t* pd = add_hhdm_to(page_table_to_address(pdpte));
-                    uint64_t* new_pd = allocate_page_table();
-
-                    for (int k = 0; k < 512; k++) {
-                        uint64_t pde = pd[k];
-                        if (pde & FLAGS_PRESENT) {
-                            uint64_t* pt = add_hhdm_to(page_table_to_address(pde));
-                            uint64_t* new_pt = allocate_page_table();
-
-                            for (int l = 0; l < 512; l++) {
-                                if (pt[l] & FLAGS_PRESENT) {
-                                    // CoW copy
-                                    uintptr_t phys = pt[l] & PAGE_MASK;
-                                    if (pt[l] & FLAGS_RW) {
-                                        pt[l] &= ~FLAGS_RW;
-                                        pt[l] |= FLAGS_COW;
-                                    }
-                                    memory_bitmap[phys / PAGE_SIZE]++;
-                                    add_hhdm_to(new_pt)[l] = (phys & PAGE_MASK) | (pt[l] & FLAGS_MASK);
-                                }
-                            }
-                            add_hhdm_to(new_pd)[k] = ((uintptr_t)new_pt & PAGE_MASK) | (pde & HIGHER_LEVEL_FLAGS);
-                        }
-                    }
-                    add_hhdm_to(new_pdpt)[j] = ((uintptr_t)new_pd & PAGE_MASK) | (pdpte & HIGHER_LEVEL_FLAGS);
-                }
-            }
-            add_hhdm_to(new_pml4)[i] = ((uintptr_t)new_pdpt & PAGE_MASK) | (pml4e & HIGHER_LEVEL_FLAGS);
+            pml4e = (pml4e & ~FLAGS_RW) | FLAGS_COW;
+            old_pml4[i] = pml4e;
+            add_hhdm_to(new_pml4)[i] = pml4e;
+            memory_bitmap[(uintptr_t)page_table_to_address(pml4e) / PAGE_SIZE]++;
         }
     }
+    flush_tlb(); // The parent lost write access to its whole lower half
+    mapping_changed(0);
     return new_pml4;
 }
 
+// Drop one reference to a table and, if it was the last, to everything it maps
+static void release_table(uintptr_t table, int level) {
+    size_t table_index = table / PAGE_SIZE;
+    if (memory_bitmap[table_index] > 1) {
+        memory_bitmap[table_index]--; // Still used by another address space
+        return;
+    }
+
+    uint64_t* entries = add_hhdm_to((uint64_t*)table);
+    for (int i = 0; i < 512; i++) {
+        uint64_t e = entries[i];
+        if (!(e & FLAGS_PRESENT)) continue;
+        if (level > 1 && (e & FLAGS_PSE)) {
+            size_t first = huge_page_to_address(e) / PAGE_SIZE;
+            for (size_t j = 0; j < HUGE_PAGE_SIZE / PAGE_SIZE; j++) put_frame(first + j);
+        } else if (level > 1) {
+            release_table((uintptr_t)page_table_to_address(e), level - 1);
+        } else {
+            put_frame((uintptr_t)page_table_to_address(e) / PAGE_SIZE);
+        }
+    }
+    put_frame(table_index);
+}
+
 void free_page_tables(void* pml4_address) {
     uint64_t* pml4 = add_hhdm_to(pml4_address);
     for (int i = 0; i < 256; i++) { // Skip higher half entries
-        uint64_t pml4e = pml4[i];
-        if (pml4e & FLAGS_PRESENT) {
-            uint64_t* pdpt = add_hhdm_to(page_table_to_address(pml4e));
-            for (int j = 0; j < 512; j++) {
-                uint64_t pdpte = pdpt[j];
-
-                if (pdpte & FLAGS_PRESENT) {
-                    uint64_t* pd = add_hhdm_to(page_table_to_address(pdpte));
-                    for (int k = 0; k < 512; k++) {
-                        uint64_t pde = pd[k];
-
-                        if (pde & FLAGS_PRESENT) {
-                            uint64_t* pt = add_hhdm_to(page_table_to_address(pde));
-
-                            for (int l = 0; l < 512; l++) {
-                                if (pt[l] & FLAGS_PRESENT) {
-                                    size_t page_index = (uint64_t)page_table_to_address(pt[l]) / PAGE_SIZE;
-                                    if (memory_bitmap[page_index] > 0) memory_bitmap[page_index]--;
-                                    if (memory_bitmap[page_index] == 0 && page_index < first_usable) first_usable = page_index;
-                                }
-                            }
-                            size_t page_index = (uint64_t)page_table_to_address(pde) / PAGE_SIZE;
-                            if (memory_bitmap[page_index] > 0) memory_bitmap[page_index]--;
-                            if (memory_bitmap[page_index] == 0 && page_index < first_usable) first_usable = page_index;
-                        }
-                    }
-                    size_t page_index = (uint64_t)page_table_to_address(pdpte) / PAGE_SIZE;
-                    if (memory_bitmap[page_index] > 0) memory_bitmap[page_index]--;
-                    if (memory_bitmap[page_index] == 0 && page_index < first_usable) first_usable = page_index;
-                }
-            }
-            size_t page_index = (uint64_t)page_table_to_address(pml4e) / PAGE_SIZE;
-            if (memory_bitmap[page_index] > 0) memory_bitmap[page_index]--;
-            if (memory_bitmap[page_index] == 0 && page_index < first_usable) first_usable = page_index;
+        if (pml4[i] & FLAGS_PRESENT) {
+            release_table((uintptr_t)page_table_to_address(pml4[i]), 3);
         }
     }
     size_t page_index = (uint64_t)pml4_address / PAGE_SIZE;
-    if (memory_bitmap[page_index] > 0) memory_bitmap[page_index]--;
-    if (memory_bitmap[page_index] == 0 && page_index < first_usable) first_usable = page_index;
+    put_frame(page_index);
 }
 
-int cow_handler(void* faulting_address) {
-    page_address_t entry = get_page_entry((uintptr_t)faulting_address);
+// Page table entry for vaddr in the current address space, with every table above it made
+// private and a huge page in the way split. Missing tables are created if create is set.
+uint64_t* get_pte(uintptr_t vaddr, uint64_t flags, int create) {
+    page_address_t entry = get_page_entry(vaddr);
+    uint64_t* pd = walk_to_pd(vaddr, flags, create, NULL);
+    uint64_t* pt = walk_to_pt(pd, vaddr, flags, create);
+    if (pt == NULL) return NULL;
+    return &pt[entry.pt_index];
+}
 
-    uint64_t* pml4 = (uint64_t*)pml4_address;
-    if (!(pml4[entry.pml4_index] & FLAGS_PRESENT)) {
-        return 0; // PML4 entry not present
-    }
+// Give the current address space a writable copy of the copy-on-write page behind pte. Returns
+// 1 if the frame was copied, 0 if this was its last user and it was made writable in place,
+// and -1 if no frame was left for the copy. A copy of the zero page is the first page charged
+// for the mapping, and is refused past the memory limit.
+int break_cow(uint64_t* pte, uintptr_t vaddr) {
+    uintptr_t phys = (uintptr_t)page_table_to_address(*pte);
+    uintptr_t page_index = phys / PAGE_SIZE;
+    int copied = 0;
+    if (memory_bitmap[page_index] > 1) {
+        // Copy the page, a write to the shared zero page only needs a cleared frame
+        if (phys == zero_page && over_memory_limit(1)) return -1;
+        uintptr_t new_phys = phys == zero_page ? alloc_zeroed_frame() : alloc_frame();
+        if (!new_phys) return -1; // Out of memory, the faulting task is the one to go
+        if (phys == zero_page) account_user_pages(vaddr, 1);
+        memory_bitmap[page_index]--;
+        memory_bitmap[new_phys / PAGE_SIZE] = 1;
+
+        if (phys != zero_page) {
+            void* old_virt = add_hhdm_to((uint64_t*)phys);
+            void* new_virt = add_hhdm_to((uint64_t*)new_phys);
+            memcpy(new_virt, old_virt, PAGE_SIZE);
+        }
 
-    uint64_t* pdpt = add_hhdm_to(page_table_to_address(pml4[entry.pml4_index]));
-    if (!(pdpt[entry.pdpt_index] & FLAGS_PRESENT)) {
-        return 0; // PDPT entry not present
+        *pte = (new_phys & PAGE_MASK) | (*pte & ~FLAGS_COW & FLAGS_MASK) | FLAGS_RW;
+        copied = 1;
+    } else {
+        *pte = (*pte & ~FLAGS_COW) | FLAGS_RW;
     }
+    asm volatile("invlpg (%0)" ::"r"(vaddr) : "memory");
+    mapping_changed(vaddr);
+    return copied;
+}
 
-    uint64_t* pd = add_hhdm_to(page_table_to_address(pdpt[entry.pdpt_index]));
-    if (!(pd[entry.pd_index] & FLAGS_PRESENT)) {
-        return 0; // PD entry not present
-    }
+void change_pml4(void* pml4) {
+    cpu_paging[cpu_id()].pml4 = add_hhdm_to(pml4);
+}
 
-    uint64_t* pt = add_hhdm_to(page_table_to_address(pd[entry.pd_index]));
-    if (!(pt[entry.pt_index] & FLAGS_PRESENT)) {
-        return 0; // PT entry not present
+// An address space gets its first generation when it is first loaded
+static uint64_t mm_generation(mm_counters_t* mm) {
+    if (mm == NULL) return 0;
+    if (mm->tlb_generation == 0) mm->tlb_generation = ++mm_generations;
+    return mm->tlb_generation;
+}
+
+// Load an address space, pcid is where its owner remembers the PCID it was last given on this
+// CPU and mm the counters user mappings are charged to, NULL for none. Nothing is reloaded when
+// it is already active and no other CPU changed it since.
+void switch_address_space(void* cr3, uint16_t* pcid, mm_counters_t* mm) {
+    cpu_paging_t* cpu = &cpu_paging[cpu_id()];
+    uint64_t generation = mm_generation(mm);
+    change_pml4(cr3);
+    cpu->mm = mm;
+    if (cr3 == cpu->loaded_cr3 && cpu->pcid_mm_generation[cpu->loaded_pcid] == generation) return;
+    cpu->loaded_cr3 = cr3;
+
+    if (!pcid_enabled) {
+        cpu->pcid_generation[0] = kernel_generation;
+        cpu->pcid_mm_generation[0] = generation;
+        asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+        return;
+    }
+    if (*pcid != 0 && cpu->pcid_owner[*pcid] == cr3 && cpu->pcid_generation[*pcid] == kernel_generation &&
+        cpu->pcid_mm_generation[*pcid] == generation) {
+        cpu->loaded_pcid = *pcid;
+        asm volatile("mov %0, %%cr3" :: "r"((uintptr_t)cr3 | *pcid | CR3_NOFLUSH) : "memory");
+        return;
+    }
+    if (*pcid == 0 || cpu->pcid_owner[*pcid] != cr3) {
+        *pcid = cpu->next_pcid;
+        cpu->next_pcid = cpu->next_pcid % (PCID_COUNT - 1) + 1;
+        cpu->pcid_owner[*pcid] = cr3;
     }
+    cpu->pcid_generation[*pcid] = kernel_generation;
+    cpu->pcid_mm_generation[*pcid] = generation;
+    cpu->loaded_pcid = *pcid;
+    // Without the no-flush bit the entries left under this PCID by a previous owner are dropped
+    asm volatile("mov %0, %%cr3" :: "r"((uintptr_t)cr3 | *pcid) : "memory");
+}
 
-    uint64_t pte = pt[entry.pt_index];
-    uintptr_t phys = pte & PAGE_MASK;
-    uintptr_t page_index = phys / PAGE_SIZE;
-    if (pte & FLAGS_COW) {
-        if (memory_bitmap[page_index] > 1) {
-            // Copy the page
-            uintptr_t new_phys = get_available_address();
-            memory_bitmap[page_index]--;
-            memory_bitmap[new_phys / PAGE_SIZE] = 1;
+// The tables every address space copies its kernel half from, loaded by an idle CPU so that
+// nothing of the task it left keeps being used
+void switch_to_kernel_space() {
+    cpu_paging_t* cpu = &cpu_paging[cpu_id()];
+    switch_address_space(kernel_cr3, &cpu->kernel_pcid, NULL);
+}
 
-            void* old_virt = add_hhdm_to((uint64_t*)phys);
-            void* new_virt = add_hhdm_to((uint64_t*)new_phys);
-            memcpy(new_virt, old_virt, PAGE_SIZE);
+// Flush the kernel entries of the current PCID if another CPU removed a kernel mapping since
+void sync_kernel_tlb() {
+    cpu_paging_t* cpu = &cpu_paging[cpu_id()];
+    if (cpu->pcid_generation[cpu->loaded_pcid] == kernel_generation) return;
+    flush_tlb();
+    cpu->pcid_generation[cpu->loaded_pcid] = kernel_generation;
+}
 
-            pt[entry.pt_index] = (new_phys & PAGE_MASK) | (pt[entry.pt_index] & ~FLAGS_COW & FLAGS_MASK) | FLAGS_RW;
-        } else {
-            pt[entry.pt_index] &= ~FLAGS_COW;
-            pt[entry.pt_index] |= FLAGS_RW;
+// Paging setup of the other CPUs, which start on the boot tables like the BSP did
+void init_paging_ap() {
+    cpu_paging_t* cpu = &cpu_paging[cpu_id()];
+    cpu->pml4 = add_hhdm_to(kernel_cr3);
+    cpu->loaded_cr3 = kernel_cr3;
+    cpu->next_pcid = 1;
+    cpu->pcid_generation[0] = kernel_generation;
+    asm volatile("mov %0, %%cr3" :: "r"(kernel_cr3) : "memory");
+
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_WP) : "memory");
+    if (pcid_enabled) {
+        uint64_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile("mov %0, %%cr4" :: "r"(cr4 | CR4_PCIDE) : "memory");
+    }
+}
+
+static void table_usage(uintptr_t table, int level, uint64_t* shared, uint64_t* tables) {
+    uint64_t* entries = add_hhdm_to((uint64_t*)table);
+    (*tables)++;
+    for (int i = 0; i < 512; i++) {
+        uint64_t e = entries[i];
+        if (!(e & FLAGS_PRESENT)) continue;
+        if (level > 1 && (e & FLAGS_PSE)) {
+            size_t first = huge_page_to_address(e) / PAGE_SIZE;
+            for (size_t j = 0; j < HUGE_PAGE_SIZE / PAGE_SIZE; j++) {
+                if (memory_bitmap[first + j] > 1) (*shared)++;
+            }
+        } else if (level > 1) {
+            table_usage((uintptr_t)page_table_to_address(e), level - 1, shared, tables);
+        } else if (memory_bitmap[(uintptr_t)page_table_to_address(e) / PAGE_SIZE] > 1) {
+            (*shared)++;
         }
-        asm volatile("invlpg (%0)" ::"r"(faulting_address) : "memory");
-        return 1;
     }
-    return 0;
 }
 
-void change_pml4(void* pml4) {
-    pml4_address = add_hhdm_to(pml4);
+// Count the user pages of an address space whose frame is also used elsewhere, and the page
+// tables it reaches. Tables shared after fork() count for every address space using them.
+void address_space_usage(void* cr3, uint64_t* shared, uint64_t* tables) {
+    uint64_t* pml4 = add_hhdm_to(cr3);
+    *shared = 0;
+    *tables = 1;
+    for (int i = 0; i < 256; i++) {
+        if (pml4[i] & FLAGS_PRESENT) table_usage((uintptr_t)page_table_to_address(pml4[i]), 3, shared, tables);
+    }
+}
+
+// Kernel pointer to a user address of another address space, for writing into it through the
+// HHDM. NULL when the page is missing or shared copy-on-write, the caller has to switch to the
+// address space and take the fault instead.
+void* writable_user_address(void* cr3, uintptr_t vaddr) {
+    page_address_t entry = get_page_entry(vaddr);
+    uint16_t indices[4] = {entry.pml4_index, entry.pdpt_index, entry.pd_index, entry.pt_index};
+    uint64_t required = FLAGS_PRESENT | FLAGS_RW | FLAGS_USER;
+
+    uint64_t* table = add_hhdm_to(cr3);
+    for (int level = 0; level < 4; level++) {
+        uint64_t e = table[indices[level]];
+        if ((e & required) != required) return NULL;
+        if (level == 2 && (e & FLAGS_PSE)) {
+            return (uint8_t*)add_hhdm_to((uint64_t*)huge_page_to_address(e)) + (vaddr & (HUGE_PAGE_SIZE - 1));
+        }
+        if (level == 3) {
+            return (uint8_t*)add_hhdm_to(page_table_to_address(e)) + (vaddr & (PAGE_SIZE - 1));
+        }
+        table = add_hhdm_to(page_table_to_address(e));
+    }
+    return NULL;
 }
@@ -1,12 +1,17 @@
 #pragma once
 #include "../limine.h"
 #include <stdint.h>
+#include <stddef.h>
 
 #define PAGE_SIZE 4096
 #define PAGE_MASK (~(PAGE_SIZE - 1))
 #define PAGE_ALIGN(addr) (((addr) + PAGE_SIZE - 1) & PAGE_MASK)
 #define FLAGS_MASK 0xFFF0000000000FFFULL
 
+#define HUGE_PAGE_SIZE 0x200000
+#define HUGE_PAGE_MASK (~(HUGE_PAGE_SIZE - 1))
+#define HUGE_PAGE_ORDER 9
+
 #define FLAGS_PRESENT  0x1
 #define FLAGS_RW       0x2
 #define FLAGS_USER     0x4
@@ -20,6 +25,26 @@
 #define FLAGS_PAT      0x1000
 #define FLAGS_NX       0x8000000000000000
 
+#define CR0_WP 0x10000
+#define CR4_PCIDE (1 << 17)
+#define CR3_NOFLUSH (1ULL << 63)
+
+#define PCID_COUNT 256 // Used per CPU, out of 4096. PCID 0 is never handed out
+#define KERNEL_HALF 0xFFFF800000000000
+
+#define BUDDY_MAX_ORDER 10 // Largest physical block is 2^10 pages (4 MiB)
+#define FRAME_NOT_FREE 0xFF
+#define FRAME_RESERVED 0xFE
+
+#define PAGE_CACHE_SIZE 64
+#define PAGE_CACHE_BATCH 32
+
+#define ZERO_POOL_SIZE 256 // Frames kept cleared in advance
+#define ZERO_POOL_REFILL 8 // Frames cleared per idle pass
+
+#define TLB_BATCH_PAGES 32 // Past this many pages a full flush is cheaper than invlpg per page
+#define TLB_BATCH_FRAMES 64
+
 typedef struct {
     uint16_t pml4_index;
     uint16_t pdpt_index;
@@ -27,14 +52,77 @@ typedef struct {
     uint16_t pt_index;
 } page_address_t;
 
+// Pages charged to an address space, only lower-half mappings count
+typedef struct {
+    int64_t resident; // User pages mapped, shared ones included but not the zero page
+    uint64_t limit;   // Most resident pages allowed, 0 for no limit
+    uint64_t tlb_generation; // Renewed on every invalidation, 0 until first loaded, see switch_address_space()
+} mm_counters_t;
+
+// Invalidations and freed frames of a multi-page unmap, flushed together by tlb_batch_flush()
+typedef struct {
+    uintptr_t pages[TLB_BATCH_PAGES];
+    size_t page_count; // May exceed TLB_BATCH_PAGES, the whole TLB is flushed then
+    size_t frames[TLB_BATCH_FRAMES];
+    size_t frame_count;
+    uint8_t kernel;
+    uint8_t user;
+} tlb_batch_t;
+
+typedef struct {
+    uintptr_t frames[PAGE_CACHE_SIZE];
+    int count;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t flushes;
+} page_cache_t;
+
+extern page_cache_t page_caches[];
+extern uint8_t pcid_enabled;
+extern uint64_t unshared_tables;
+extern uintptr_t zero_page;
+extern uint64_t zero_pool_hits;
+extern uint64_t zero_pool_misses;
+
 void init_paging(uintptr_t cr3, struct limine_memmap_response *memmap, uintptr_t hhdm);
+uintptr_t alloc_frames(unsigned order, uintptr_t max_phys);
+void free_frames(uintptr_t phys, unsigned order);
+uintptr_t alloc_frame();
+void free_frame(uintptr_t phys);
+uintptr_t alloc_zeroed_frame();
+int refill_zero_pool(int count);
+void ref_frame(uintptr_t phys);
+void unref_frame(uintptr_t phys);
+uint32_t frame_refcount(uintptr_t phys);
 void* alloc_page(uintptr_t addr, uint64_t flags);
+void* alloc_zeroed_page(uintptr_t vaddr, uint64_t flags);
+void* map_frame(uintptr_t vaddr, uintptr_t phys, uint64_t flags);
+void* alloc_huge_page(uintptr_t vaddr, uint64_t flags);
 void* alloc_mmio_page(uintptr_t vaddr, uintptr_t paddr, uint64_t flags);
+void* alloc_contiguous_pages(uintptr_t vaddr, size_t pages, uintptr_t max_phys, uint64_t flags);
 uintptr_t get_physical_address(uintptr_t virtual_address);
 int free_page(void* page);
+int free_huge_page(void* page);
+int set_page_flags(uintptr_t vaddr, uint64_t flags);
+void protect_range(uintptr_t vaddr, size_t size, uint64_t flags);
+void unmap_range(uintptr_t vaddr, size_t size);
+void tlb_batch_init(tlb_batch_t* batch);
+void tlb_batch_add(tlb_batch_t* batch, uintptr_t vaddr);
+void tlb_batch_flush(tlb_batch_t* batch);
+void* create_address_space();
 void* clone_page_tables(void* pml4_address);
 void free_page_tables(void* pml4_address);
-int cow_handler(void* faulting_address);
+uint64_t* get_pte(uintptr_t vaddr, uint64_t flags, int create);
+int break_cow(uint64_t* pte, uintptr_t vaddr);
 void change_pml4(void* pml4);
+void switch_address_space(void* cr3, uint16_t* pcid, mm_counters_t* mm);
+void switch_to_kernel_space();
+void sync_kernel_tlb();
+void init_paging_ap();
+void account_user_pages(uintptr_t vaddr, int64_t pages);
+int over_memory_limit(uint64_t new_pages);
+void address_space_usage(void* cr3, uint64_t* shared, uint64_t* tables);
+void* writable_user_address(void* cr3, uintptr_t vaddr);
 
 page_address_t get_page_entry(uintptr_t addr);
+uint64_t* add_hhdm_to(uint64_t* ptr);
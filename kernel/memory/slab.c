@@ -0,0 +1,128 @@
+#include "slab.h"
+#include "mman.h"
+#include "paging.h"
+#include "../panic.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Each slab is a single page with the slab_t header at its start. Objects are
+// laid out at multiples of the object size, so they are naturally aligned and
+// never start on a page boundary, which is how kfree() tells them apart from
+// page-granular allocations.
+slab_cache_t slab_caches[SLAB_CACHE_COUNT] = {
+    {.object_size = 16},
+    {.object_size = 32},
+    {.object_size = 64},
+    {.object_size = 128},
+    {.object_size = 256},
+    {.object_size = 512},
+    {.object_size = 1024},
+};
+
+static int cache_index(size_t size) {
+    int index = 0;
+    size_t object_size = SLAB_MIN_SIZE;
+    while (object_size < size) {
+        object_size <<= 1;
+        index++;
+    }
+    return index;
+}
+
+static void unlink_slab(slab_cache_t* cache, slab_t* slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else cache->partial = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+static void push_partial(slab_cache_t* cache, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = cache->partial;
+    if (cache->partial) cache->partial->prev = slab;
+    cache->partial = slab;
+}
+
+static slab_t* new_slab(slab_cache_t* cache) {
+    slab_t* slab = kmalloc(PAGE_SIZE);
+    size_t size = cache->object_size;
+    size_t first = (sizeof(slab_t) + size - 1) & ~(size - 1);
+
+    slab->magic = SLAB_MAGIC;
+    slab->object_size = size;
+    slab->total_count = (PAGE_SIZE - first) / size;
+    slab->free_count = slab->total_count;
+    slab->next = NULL;
+    slab->prev = NULL;
+
+    // Thread the free list through the objects themselves
+    void* next = NULL;
+    for (size_t offset = PAGE_SIZE - size; offset >= first; offset -= size) {
+        void** object = (void**)((uintptr_t)slab + offset);
+        *object = next;
+        next = object;
+    }
+    slab->free_list = next;
+
+    cache->slab_pages++;
+    return slab;
+}
+
+void* slab_alloc(size_t size) {
+    if (size > SLAB_MAX_SIZE) panic("slab_alloc: %d bytes is too large for a slab", size);
+    slab_cache_t* cache = &slab_caches[cache_index(size)];
+
+    if (cache->partial == NULL) {
+        slab_t* slab = cache->empty;
+        if (slab) {
+            cache->empty = NULL;
+        } else {
+            slab = new_slab(cache);
+        }
+        push_partial(cache, slab);
+    }
+
+    slab_t* slab = cache->partial;
+    void** object = slab->free_list;
+    slab->free_list = *object;
+    slab->free_count--;
+    if (slab->free_count == 0) {
+        unlink_slab(cache, slab); // Full slabs are not kept on any list
+    }
+
+    cache->allocations++;
+    memset(object, 0, size);
+    return object;
+}
+
+void slab_free(void* ptr) {
+    slab_t* slab = (slab_t*)((uintptr_t)ptr & PAGE_MASK);
+    if (slab->magic != SLAB_MAGIC) panic("slab_free: 0x%p is not a slab object", ptr);
+    slab_cache_t* cache = &slab_caches[cache_index(slab->object_size)];
+
+    *(void**)ptr = slab->free_list;
+    slab->free_list = ptr;
+    slab->free_count++;
+
+    if (slab->free_count == 1) {
+        push_partial(cache, slab); // Was full
+    }
+
+    if (slab->free_count == slab->total_count) {
+        unlink_slab(cache, slab);
+        if (cache->empty == NULL) {
+            cache->empty = slab;
+        } else {
+            slab->magic = 0;
+            cache->slab_pages--;
+            kfree(slab);
+        }
+    }
+    cache->allocations--;
+}
+
+size_t slab_object_size(void* ptr) {
+    slab_t* slab = (slab_t*)((uintptr_t)ptr & PAGE_MASK);
+    return slab->object_size;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define SLAB_MIN_SIZE 16
+#define SLAB_MAX_SIZE 1024
+#define SLAB_CACHE_COUNT 7 // 16, 32, 64, 128, 256, 512, 1024
+#define SLAB_MAGIC 0x51AB
+
+typedef struct Slab {
+    uint16_t magic;
+    uint16_t object_size;
+    uint16_t free_count;
+    uint16_t total_count;
+    void* free_list;
+    struct Slab* next;
+    struct Slab* prev;
+} slab_t;
+
+typedef struct {
+    size_t object_size;
+    slab_t* partial;       // Slabs with at least one free object
+    slab_t* empty;         // One fully free slab kept around to avoid page churn
+    uint64_t allocations;
+    uint64_t slab_pages;
+} slab_cache_t;
+
+void* slab_alloc(size_t size);
+void slab_free(void* ptr);
+size_t slab_object_size(void* ptr);
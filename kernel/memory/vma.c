@@ -0,0 +1,134 @@
+#include "vma.h"
+#include "mman.h"
+#include "paging.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// The list is kept sorted by start address
+vma_t* vma_add(vma_t** list, uintptr_t start, uintptr_t end, uint64_t flags) {
+    vma_t* vma = kmalloc(sizeof(vma_t));
+    if (vma == NULL) return NULL;
+    vma->start = start & PAGE_MASK;
+    vma->end = PAGE_ALIGN(end);
+    vma->flags = flags;
+    vma->file = NULL;
+    vma->offset = 0;
+
+    while (*list && (*list)->start < vma->start) list = &(*list)->next;
+    vma->next = *list;
+    *list = vma;
+    return vma;
+}
+
+vma_t* vma_find(vma_t* list, uintptr_t addr) {
+    for (vma_t* vma = list; vma && vma->start <= addr; vma = vma->next) {
+        if (addr < vma->end) return vma;
+    }
+    return NULL;
+}
+
+vma_t* vma_find_start(vma_t* list, uintptr_t start) {
+    for (vma_t* vma = list; vma; vma = vma->next) {
+        if (vma->start == start) return vma;
+    }
+    return NULL;
+}
+
+// First area intersecting [start, end), zero-length areas count if they sit inside the range
+vma_t* vma_overlap(vma_t* list, uintptr_t start, uintptr_t end) {
+    for (vma_t* vma = list; vma && vma->start < end; vma = vma->next) {
+        if (vma->end > start) return vma;
+    }
+    return NULL;
+}
+
+int vma_covers(vma_t* list, uintptr_t start, uintptr_t end) {
+    uintptr_t covered = start;
+    for (vma_t* vma = list; vma && vma->start <= covered && covered < end; vma = vma->next) {
+        if (vma->end > covered) covered = vma->end;
+    }
+    return covered >= end;
+}
+
+// Lowest address at or above base where length bytes fit between the existing areas
+uintptr_t vma_find_gap(vma_t* list, uintptr_t base, uintptr_t limit, size_t length, size_t align) {
+    uintptr_t candidate = (base + align - 1) & ~(align - 1);
+    for (vma_t* vma = list; vma; vma = vma->next) {
+        if (vma->end <= candidate) continue;
+        if (vma->start >= candidate + length) break;
+        candidate = (vma->end + align - 1) & ~(align - 1);
+    }
+    if (candidate + length > limit || candidate + length < candidate) return 0;
+    return candidate;
+}
+
+// Cut vma in two at addr and return the upper half
+static vma_t* vma_split(vma_t* vma, uintptr_t addr) {
+    vma_t* upper = kmalloc(sizeof(vma_t));
+    *upper = *vma;
+    upper->start = addr;
+    if (upper->file) {
+        upper->offset += addr - vma->start;
+        hold_cached_file(upper->file);
+    }
+    vma->end = addr;
+    vma->next = upper;
+    return upper;
+}
+
+// Split the areas straddling start or end so that [start, end) is made of whole areas,
+// and return the first of them
+vma_t* vma_isolate(vma_t** list, uintptr_t start, uintptr_t end) {
+    vma_t* first = NULL;
+    for (vma_t* vma = *list; vma && vma->start < end; vma = vma->next) {
+        if (vma->end <= start) continue;
+        if (vma->start < start) vma = vma_split(vma, start);
+        if (vma->end > end) vma_split(vma, end);
+        if (first == NULL) first = vma;
+    }
+    return first;
+}
+
+void vma_remove(vma_t** list, uintptr_t start, uintptr_t end) {
+    vma_isolate(list, start, end);
+    while (*list) {
+        vma_t* vma = *list;
+        if (vma->start >= start && vma->end <= end && vma->start < end) {
+            *list = vma->next;
+            if (vma->file) release_cached_file(vma->file);
+            kfree(vma);
+        } else {
+            list = &vma->next;
+        }
+    }
+}
+
+vma_t* vma_clone(vma_t* list) {
+    vma_t* head = NULL;
+    vma_t** tail = &head;
+    for (vma_t* vma = list; vma; vma = vma->next) {
+        vma_t* copy = kmalloc(sizeof(vma_t));
+        *copy = *vma;
+        copy->next = NULL;
+        if (copy->file) hold_cached_file(copy->file);
+        *tail = copy;
+        tail = &copy->next;
+    }
+    return head;
+}
+
+void vma_free_all(vma_t* list) {
+    while (list) {
+        vma_t* next = list->next;
+        if (list->file) release_cached_file(list->file);
+        kfree(list);
+        list = next;
+    }
+}
+
+// Map the part of the range the kernel is about to write from another address space
+void vma_populate(vma_t* vma, uintptr_t start, uintptr_t end) {
+    for (uintptr_t page = start & PAGE_MASK; page < PAGE_ALIGN(end); page += PAGE_SIZE) {
+        if (!get_physical_address(page)) alloc_zeroed_page(page, vma->flags);
+    }
+}
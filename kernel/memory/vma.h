@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "../mount.h"
+
+// A range of user address space whose pages are only allocated when they are first
+// touched, either zero-filled or taken from the page cache of a file
+typedef struct Vma {
+    uintptr_t start;
+    uintptr_t end;
+    uint64_t flags; // Page flags used when a page of the range is faulted in, no FLAGS_USER means PROT_NONE
+    cached_file_t* file;     // NULL for anonymous memory
+    size_t offset;           // File offset of start
+    struct Vma* next;
+} vma_t;
+
+vma_t* vma_add(vma_t** list, uintptr_t start, uintptr_t end, uint64_t flags);
+vma_t* vma_find(vma_t* list, uintptr_t addr);
+vma_t* vma_find_start(vma_t* list, uintptr_t start);
+vma_t* vma_overlap(vma_t* list, uintptr_t start, uintptr_t end);
+int vma_covers(vma_t* list, uintptr_t start, uintptr_t end);
+uintptr_t vma_find_gap(vma_t* list, uintptr_t base, uintptr_t limit, size_t length, size_t align);
+vma_t* vma_isolate(vma_t** list, uintptr_t start, uintptr_t end);
+void vma_remove(vma_t** list, uintptr_t start, uintptr_t end);
+vma_t* vma_clone(vma_t* list);
+void vma_free_all(vma_t* list);
+void vma_populate(vma_t* vma, uintptr_t start, uintptr_t end);
@@ -1,7 +1,9 @@
 #include "mount.h"
 #include "memory/mman.h"
+#include "memory/paging.h"
 #include "usermode/scheduler.h"
 #include "fs/fat.h"
+#include "string.h"
 #include <stddef.h>
 #include <stdint.h>
 
@@ -10,13 +12,11 @@ mountpoint_t mountpoints[48] = {0};
 
 int filesystem_count = 0;
 
-static size_t strlen(const char *s) {
-    size_t len = 0;
-    while (s[len] != '\0') {
-        len++;
-    }
-    return len;
-}
+cached_page_t* file_cache[FILE_CACHE_BUCKETS] = {0};
+cached_file_t* cached_files = NULL;
+size_t file_cache_pages = 0;
+uint64_t file_cache_hits = 0;
+uint64_t file_cache_misses = 0;
 
 int register_filesystem(filesystem_t fs) {
     if (filesystem_count >= 24) {
@@ -26,33 +26,6 @@ int register_filesystem(filesystem_t fs) {
     return 0; // Success
 }
 
-static int strcmp(const char *s1, const char *s2) {
-    while (*s1 && *s2 && (*s1 == *s2)) {
-        s1++;
-        s2++;
-    }
-    return *(unsigned char *)s1 - *(unsigned char *)s2;
-}
-
-static char *strcpy(char *dest, const char *src) {
-    char *ret = dest;
-    while ((*dest++ = *src++)); // copy until '\0'
-    return ret;
-}
-
-static char *strncpy(char *dest, const char *src, size_t len) {
-    char *ret = dest;
-    int i = 0;
-    while ((i++ < len) && (*dest++ = *src++)); // copy until '\0'
-    return ret;
-}
-
-static void strcat(char *dest, const char *src) {
-    while (*dest) dest++;
-    while (*src) *dest++ = *src++;
-    *dest = '\0';
-}
-
 // Resolve relative path to absolute
 char* resolve_path(char *rel_path) {
     static char temp[MAX_PATH + 1];
@@ -215,6 +188,163 @@ static void separate_mount_point_and_path(const char *path, char *mount_point, c
     }
 }
 
+static size_t cache_bucket(cached_file_t *file, size_t index) {
+    return (((uintptr_t)file >> 4) ^ (index * 0x9E3779B97F4A7C15ULL)) % FILE_CACHE_BUCKETS;
+}
+
+static cached_page_t *find_cached_page(cached_file_t *file, size_t index) {
+    for (cached_page_t *page = file_cache[cache_bucket(file, index)]; page; page = page->hash_next) {
+        if (page->file == file && page->index == index) return page;
+    }
+    return NULL;
+}
+
+static void unhash_cached_page(cached_page_t *page) {
+    cached_page_t **link = &file_cache[cache_bucket(page->file, page->index)];
+    while (*link != page) link = &(*link)->hash_next;
+    *link = page->hash_next;
+    unref_frame(page->phys);
+    file_cache_pages--;
+}
+
+// Drop every cached page that no process has mapped
+static void shrink_file_cache() {
+    for (cached_file_t *file = cached_files; file; file = file->next) {
+        cached_page_t **link = &file->pages;
+        while (*link) {
+            cached_page_t *page = *link;
+            if (frame_refcount(page->phys) == 1) {
+                *link = page->file_next;
+                unhash_cached_page(page);
+                kfree(page);
+            } else {
+                link = &page->file_next;
+            }
+        }
+    }
+}
+
+static cached_file_t *find_cached_file(const char *path) {
+    for (cached_file_t *file = cached_files; file; file = file->next) {
+        if (strcmp(file->path, path) == 0) return file;
+    }
+    return NULL;
+}
+
+cached_file_t *open_cached_file(const char *path) {
+    path = resolve_path((char*)path);
+    char resolved_path[256] = {0};
+    resolve_dot_or_dotdot(path, resolved_path);
+    path = resolved_path;
+
+    cached_file_t *file = find_cached_file(path);
+    if (file) {
+        file->users++;
+        return file;
+    }
+    if (!exists(path) || is_directory(path)) return NULL;
+
+    char mount_point[256] = {0};
+    char relative_path[256] = {0};
+    separate_mount_point_and_path(path, mount_point, relative_path);
+    for (int i = 0; i < 48; i++) {
+        if (strcmp(mountpoints[i].mount_point, mount_point) == 0) {
+            file = kmalloc(sizeof(cached_file_t));
+            strcpy(file->path, path);
+            strcpy(file->relative_path, relative_path);
+            file->mount = i;
+            file->users = 1;
+            file->next = cached_files;
+            cached_files = file;
+            return file;
+        }
+    }
+    return NULL; // Mount point not found
+}
+
+void hold_cached_file(cached_file_t *file) {
+    file->users++;
+}
+
+void release_cached_file(cached_file_t *file) {
+    // Pages stay cached for the next user, only removed files are forgotten
+    if (--file->users == 0 && file->removed) kfree(file);
+}
+
+// Returns the frame holding the given page of the file, reading it in on a miss. The frame
+// belongs to the cache, mappers take their own reference. Returns 0 past the end of the file.
+uintptr_t get_cached_page(cached_file_t *file, size_t index) {
+    cached_page_t *page = find_cached_page(file, index);
+    if (page) {
+        file_cache_hits++;
+        return page->phys;
+    }
+    file_cache_misses++;
+
+    mountpoint_t *mount = &mountpoints[file->mount];
+    if (file->removed || mount->mount_point[0] == '\0') return 0;
+    filesystem_t *fs = &filesystems[find_filesystem(mount->type)];
+    if (!fs->read) return 0;
+
+    if (file_cache_pages >= FILE_CACHE_MAX_PAGES) shrink_file_cache();
+    uintptr_t phys = alloc_frame();
+    if (!phys) return 0;
+    ref_frame(phys);
+    uint8_t *data = (uint8_t*)add_hhdm_to((uint64_t*)phys);
+    memset(data, 0, PAGE_SIZE);
+
+    fs->set_read_only(mount->flags & FLAG_READ_ONLY);
+    fs->select(mount->drive, mount->partition);
+    if (fs->read(file->relative_path, data, index * PAGE_SIZE, PAGE_SIZE) <= 0) {
+        unref_frame(phys);
+        return 0;
+    }
+
+    page = kmalloc(sizeof(cached_page_t));
+    page->file = file;
+    page->index = index;
+    page->phys = phys;
+    size_t bucket = cache_bucket(file, index);
+    page->hash_next = file_cache[bucket];
+    file_cache[bucket] = page;
+    page->file_next = file->pages;
+    file->pages = page;
+    file_cache_pages++;
+    return phys;
+}
+
+// Write-through: copy freshly written data into any cached pages of the file
+static void update_cached_pages(const char *path, const uint8_t *buffer, size_t offset, size_t size) {
+    cached_file_t *file = find_cached_file(path);
+    if (file == NULL) return;
+    for (size_t index = offset / PAGE_SIZE; index <= (offset + size - 1) / PAGE_SIZE; index++) {
+        cached_page_t *page = find_cached_page(file, index);
+        if (page == NULL) continue;
+        size_t start = index * PAGE_SIZE > offset ? index * PAGE_SIZE : offset;
+        size_t end = (index + 1) * PAGE_SIZE < offset + size ? (index + 1) * PAGE_SIZE : offset + size;
+        uint8_t *data = (uint8_t*)add_hhdm_to((uint64_t*)page->phys);
+        memcpy(data + start - index * PAGE_SIZE, buffer + start - offset, end - start);
+    }
+}
+
+static void drop_cached_file(const char *path) {
+    cached_file_t *file = find_cached_file(path);
+    if (file == NULL) return;
+
+    cached_file_t **link = &cached_files;
+    while (*link != file) link = &(*link)->next;
+    *link = file->next;
+
+    while (file->pages) {
+        cached_page_t *page = file->pages;
+        file->pages = page->file_next;
+        unhash_cached_page(page);
+        kfree(page);
+    }
+    file->removed = 1;
+    if (file->users == 0) kfree(file);
+}
+
 int mount_filesystem(const char *path, const char *type, int drive, int partition, int flags) {
     path = resolve_path((char*)path);
     if (filesystem_count == 0) {
@@ -422,7 +552,9 @@ int write_file(const char *path, const uint8_t *buffer, size_t offset, size_t si
             fs->set_read_only(mountpoints[i].flags & FLAG_READ_ONLY); // Set read-only mode if applicable
             fs->select(mountpoints[i].drive, mountpoints[i].partition); // Select the filesystem
             if (fs && fs->write) {
-                return fs->write(relative_path, buffer, offset, size);
+                int written = fs->write(relative_path, buffer, offset, size);
+                if (written > 0) update_cached_pages(path, buffer, offset, written); // Keep mappings coherent
+                return written;
             }
             return -2; // Filesystem does not support writing
         }
@@ -450,7 +582,9 @@ int remove_file(const char *path) {
             fs->set_read_only(mountpoints[i].flags & FLAG_READ_ONLY); // Set read-only mode if applicable
             fs->select(mountpoints[i].drive, mountpoints[i].partition); // Select the filesystem
             if (fs && fs->remove) {
-                return fs->remove(relative_path);
+                int ret = fs->remove(relative_path);
+                if (ret == 0) drop_cached_file(path);
+                return ret;
             }
             return -2; // Filesystem does not support removal
         }
@@ -34,6 +34,29 @@ typedef struct {
 #define FLAG_READ_ONLY 0x01
 #define MAX_PATH 1024
 
+#define FILE_CACHE_BUCKETS 1024
+#define FILE_CACHE_MAX_PAGES 16384 // Unmapped pages are dropped past 64 MiB
+
+// A file whose pages are kept in the page cache, the path is resolved once so that
+// page faults can read straight from the filesystem
+typedef struct CachedFile {
+    char path[256];
+    char relative_path[256];
+    int mount;
+    int users;              // Mappings holding on to the file
+    int removed;
+    struct CachedPage* pages;
+    struct CachedFile* next;
+} cached_file_t;
+
+typedef struct CachedPage {
+    cached_file_t* file;
+    size_t index;
+    uintptr_t phys;
+    struct CachedPage* hash_next;
+    struct CachedPage* file_next;
+} cached_page_t;
+
 int register_filesystem(filesystem_t fs);
 int mount_filesystem(const char *path, const char *type, int drive, int partition, int flags);
 int unmount_filesystem(const char *path);
@@ -49,6 +72,10 @@ int create_file(const char *path);
 int create_directory(const char *path);
 int get_creation_time(const char *path, uint64_t *timestamp);
 int get_last_modification_time(const char *path, uint64_t *timestamp);
+cached_file_t* open_cached_file(const char *path);
+void hold_cached_file(cached_file_t *file);
+void release_cached_file(cached_file_t *file);
+uintptr_t get_cached_page(cached_file_t *file, size_t index);
 void register_intree_filesystems();
 void getcwd(char* buffer, size_t len);
 int chdir(char* path);
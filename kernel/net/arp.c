@@ -2,6 +2,7 @@
 #include "../drivers/net.h"
 #include "ethernet.h"
 #include "../memory/mman.h"
+#include "../smp.h"
 #include <stdint.h>
 
 static arp_entry_t arp_cache[ARP_CACHE_SIZE] = {0};
@@ -88,7 +89,7 @@ void arp_request(uint8_t* target_ip, uint8_t* target_mac_buffer, int card) {
     waiting_for_reply = 1;
     send_ethernet((char *)request.sender_mac, BROADCAST_MAC, ARP_ETHERTYPE, padded_frame, 60 - 14, card);
 
-    while (waiting_for_reply); // Wait for the reply (blocking)
+    while (waiting_for_reply) kernel_relax(); // Wait for the reply (blocking)
 
     // After receiving the reply, the MAC address should be in the cache
     for (int i = 0; i < ARP_CACHE_SIZE; i++) {
@@ -4,6 +4,7 @@
 #include "ethernet.h"
 #include "../drivers/net.h"
 #include "../memory/mman.h"
+#include "../smp.h"
 #include <stdint.h>
 
 
@@ -55,7 +56,7 @@ void dhcp_run(int card) {
     waiting_for_dhcp = 1;
     udp_send(IP_BROADCAST_ADDR, DHCP_CLIENT_PORT, DHCP_SERVER_PORT, (uint8_t*)&dhcp_discover, sizeof(dhcp_packet_t));
     // Wait for DHCP OFFER
-    while (waiting_for_dhcp);
+    while (waiting_for_dhcp) kernel_relax();
 
     // Parse DHCP OFFER packet
     memcpy(offered_ip, dhcp_offer_packet.yiaddr, 4);
@@ -99,7 +100,7 @@ void dhcp_run(int card) {
     waiting_for_dhcp = 1;
     udp_send(IP_BROADCAST_ADDR, DHCP_CLIENT_PORT, DHCP_SERVER_PORT, (uint8_t*)&dhcp_request, sizeof(dhcp_packet_t));
     // Wait for DHCP ACK
-    while (waiting_for_dhcp);
+    while (waiting_for_dhcp) kernel_relax();
 
     uint8_t ip[4];
     uint8_t subnet_mask[4];
@@ -1,6 +1,7 @@
 #include <stdint.h>
 #include "ip.h"
 #include "../memory/mman.h"
+#include "../smp.h"
 #include "ethernet.h"
 #include "../drivers/timer.h"
 #include "icmp.h"
@@ -108,7 +109,7 @@ int ping(uint8_t *dest_ip) {
     pinging = 1;
     icmp_send(dest_ip, ICMP_ECHO_REQUEST, 0, 123, 0, (uint8_t*)ping_data, sizeof(ping_data));
     uint64_t start = get_uptime_milliseconds();
-    while (pinging == 1);
+    while (pinging == 1) kernel_relax();
     if (pinging == 0) {
         uint16_t elapsed = get_uptime_milliseconds() - start;
         return elapsed; // Ping successful
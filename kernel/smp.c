@@ -0,0 +1,128 @@
+#include "smp.h"
+#include "gdt.h"
+#include "idt.h"
+#include "console.h"
+#include "io/lapic.h"
+#include "memory/paging.h"
+#include "memory/kstack.h"
+#include "drivers/fpu.h"
+#include "drivers/timer.h"
+#include "usermode/scheduler.h"
+#include <stdint.h>
+
+cpu_t cpus[MAX_CPUS];
+int cpu_count = 1;
+
+// Only one CPU runs kernel code at a time. Every entry through interrupt_handler() takes the
+// lock, it is dropped on the way back to user mode and while a CPU idles. It nests, as
+// interrupts and faults are taken while the kernel already holds it.
+static spinlock_t big_kernel_lock;
+
+// Point the GS base at the CPU's state, before anything calls cpu_id()
+void init_cpu_local(int id) {
+    cpu_t* cpu = &cpus[id];
+    cpu->self = cpu;
+    cpu->id = id;
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+    wrmsr(MSR_KERNEL_GS_BASE, 0); // User mode starts with a GS base of 0
+}
+
+static void acquire(int depth) {
+    spin_lock(&big_kernel_lock);
+    this_cpu()->lock_depth = depth;
+    sync_kernel_tlb(); // Kernel mappings may have been removed while this CPU was out
+}
+
+// Called with interrupts disabled
+void kernel_lock() {
+    cpu_t* cpu = this_cpu();
+    if (cpu->lock_depth) {
+        cpu->lock_depth++;
+    } else {
+        acquire(1);
+    }
+}
+
+void kernel_unlock() {
+    cpu_t* cpu = this_cpu();
+    if (--cpu->lock_depth == 0) spin_unlock(&big_kernel_lock);
+}
+
+void kernel_unlock_all() {
+    cpu_t* cpu = this_cpu();
+    if (cpu->lock_depth == 0) return;
+    cpu->lock_depth = 0;
+    spin_unlock(&big_kernel_lock);
+}
+
+// Drop the lock for work that touches nothing shared, interrupts may stay enabled. Returns
+// the depth to hand back to kernel_resume().
+int kernel_suspend() {
+    uint64_t flags = irq_save();
+    int depth = this_cpu()->lock_depth;
+    kernel_unlock_all();
+    irq_restore(flags);
+    return depth;
+}
+
+void kernel_resume(int depth) {
+    uint64_t flags = irq_save();
+    if (depth) acquire(depth);
+    irq_restore(flags);
+}
+
+// Let the other CPUs in while busy-waiting for an interrupt, which may be delivered to one of them
+void kernel_relax() {
+    int depth = kernel_suspend();
+    asm volatile("pause");
+    kernel_resume(depth);
+}
+
+static void __attribute__((noreturn)) ap_main(struct limine_smp_info* info) {
+    int id = info->extra_argument;
+    init_cpu_local(id);
+    init_paging_ap();
+    gdt_init();
+    idt_init_ap();
+    init_fpu();
+    lapic_init();
+    timer_start();
+    __atomic_store_n(&cpus[id].online, 1, __ATOMIC_RELEASE);
+
+    // The BSP still sets the kernel up without the lock until it starts init
+    while (!scheduler_initialized) asm volatile("pause");
+    kernel_lock();
+    enter_scheduler();
+}
+
+// Start the other CPUs one at a time. Everything they need is allocated here, so they come
+// up without touching the allocators while the BSP is still using them unlocked.
+void start_aps(struct limine_smp_response* smp) {
+    cpu_t* bsp = this_cpu();
+    bsp->idle_stack = alloc_kernel_stack();
+    bsp->online = 1;
+    if (!lapic_present()) {
+        timer_start(); // On the PIT, and no other CPUs to start
+        return;
+    }
+
+    lapic_init();
+    bsp->lapic_id = lapic_id();
+    lapic_calibrate();
+    timer_start();
+    if (smp == NULL) return;
+
+    for (uint64_t i = 0; i < smp->cpu_count && cpu_count < MAX_CPUS; i++) {
+        struct limine_smp_info* info = smp->cpus[i];
+        if (info->lapic_id == smp->bsp_lapic_id) continue;
+
+        int id = cpu_count++;
+        cpus[id].lapic_id = info->lapic_id;
+        cpus[id].idle_stack = alloc_kernel_stack();
+        gdt_alloc_stacks(id);
+        info->extra_argument = id;
+        __atomic_store_n(&info->goto_address, ap_main, __ATOMIC_RELEASE);
+        while (!__atomic_load_n(&cpus[id].online, __ATOMIC_ACQUIRE)) asm volatile("pause");
+    }
+    kprintf("%d CPUs online\n", (int64_t)cpu_count);
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include "limine.h"
+#include "cpu.h"
+
+void init_cpu_local(int id);
+void start_aps(struct limine_smp_response* smp);
+void kernel_lock();
+void kernel_unlock();
+void kernel_unlock_all();
+void kernel_relax();
+int kernel_suspend();
+void kernel_resume(int depth);
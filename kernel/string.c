@@ -0,0 +1,161 @@
+#include "string.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Enhanced REP MOVSB/STOSB: the byte forms are then the fastest way to move anything
+// but small blocks, without the quadword-plus-tail split
+int erms_supported = 0;
+
+// Below this, the startup cost of a rep string instruction outweighs its throughput
+#define REP_THRESHOLD 64
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_u64;
+
+// Until this has run the mem* functions take the rep movsq/stosq paths
+void init_string() {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+    if (eax < 7) return;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+    erms_supported = (ebx >> 9) & 1;
+}
+
+int memcmp(const void *ptr1, const void *ptr2, size_t n){
+    const unsigned char *p1 = (const unsigned char *)ptr1;
+    const unsigned char *p2 = (const unsigned char *)ptr2;
+
+    // Skip equal words, the first difference is then found within one word
+    while (n >= 8 && *(const unaligned_u64*)p1 == *(const unaligned_u64*)p2) {
+        p1 += 8;
+        p2 += 8;
+        n -= 8;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (p1[i] != p2[i]) {
+            return p1[i] - p2[i];
+        }
+    }
+    return 0; // Memory regions are equal
+}
+
+void* memcpy(void* dest, const void* src, size_t n) {
+    unsigned char *d = (unsigned char *)dest;
+    const unsigned char *s = (const unsigned char *)src;
+
+    if (n < REP_THRESHOLD) {
+        for (; n >= 8; n -= 8, d += 8, s += 8) *(unaligned_u64*)d = *(const unaligned_u64*)s;
+        while (n--) *d++ = *s++;
+    } else if (erms_supported) {
+        asm volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(n) :: "memory");
+    } else {
+        size_t words = n / 8;
+        n &= 7;
+        asm volatile("rep movsq; mov %3, %%rcx; rep movsb" : "+D"(d), "+S"(s), "+c"(words) : "r"(n) : "memory");
+    }
+    return dest;
+}
+
+void* memset(void* ptr, unsigned char value, size_t n) {
+    unsigned char *p = (unsigned char *)ptr;
+    uint64_t pattern = value * 0x0101010101010101ULL;
+
+    if (n < REP_THRESHOLD) {
+        for (; n >= 8; n -= 8, p += 8) *(unaligned_u64*)p = pattern;
+        while (n--) *p++ = value;
+    } else if (erms_supported) {
+        asm volatile("rep stosb" : "+D"(p), "+c"(n) : "a"(pattern) : "memory");
+    } else {
+        size_t words = n / 8;
+        n &= 7;
+        asm volatile("rep stosq; mov %3, %%rcx; rep stosb" : "+D"(p), "+c"(words) : "a"(pattern), "r"(n) : "memory");
+    }
+    return ptr;
+}
+
+void* memmove(void* dest, const void* src, size_t n) {
+    unsigned char *d = (unsigned char *)dest;
+    const unsigned char *s = (const unsigned char *)src;
+
+    if (d <= s || d >= s + n) {
+        // A forward copy never overwrites source bytes it has yet to read
+        return memcpy(dest, src, n);
+    }
+
+    // Overlapping with dest above src, copy from the top down. A word loop rather than
+    // std; rep movsq, so that nothing runs with the direction flag set.
+    for (; n >= 8; n -= 8) *(unaligned_u64*)(d + n - 8) = *(const unaligned_u64*)(s + n - 8);
+    while (n--) d[n] = s[n];
+    return dest;
+}
+
+// The str* functions scan a word at a time. Words are only read from aligned addresses,
+// so reading past the terminator never crosses into the next, possibly unmapped, page.
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+#define HAS_ZERO(word) (((word) - ONES) & ~(word) & HIGHS)
+
+typedef uint64_t __attribute__((may_alias)) word_t;
+
+size_t strlen(const char* s) {
+    const char* p = s;
+    for (; (uintptr_t)p & 7; p++) {
+        if (*p == '\0') return p - s;
+    }
+    while (!HAS_ZERO(*(const word_t*)p)) p += 8;
+    while (*p) p++;
+    return p - s;
+}
+
+size_t strnlen(const char* s, size_t max) {
+    size_t len = 0;
+    for (; len < max && ((uintptr_t)(s + len) & 7); len++) {
+        if (s[len] == '\0') return len;
+    }
+    while (len + 8 <= max && !HAS_ZERO(*(const word_t*)(s + len))) len += 8;
+    while (len < max && s[len]) len++;
+    return len;
+}
+
+int strcmp(const char* s1, const char* s2) {
+    // Words can only be compared when both strings have the same alignment
+    if ((((uintptr_t)s1 ^ (uintptr_t)s2) & 7) == 0) {
+        for (; (uintptr_t)s1 & 7; s1++, s2++) {
+            if (*s1 != *s2 || *s1 == '\0') return (unsigned char)*s1 - (unsigned char)*s2;
+        }
+        while (*(const word_t*)s1 == *(const word_t*)s2 && !HAS_ZERO(*(const word_t*)s1)) {
+            s1 += 8;
+            s2 += 8;
+        }
+    }
+    while (*s1 && *s1 == *s2) {
+        s1++;
+        s2++;
+    }
+    return (unsigned char)*s1 - (unsigned char)*s2;
+}
+
+char* strcpy(char* dest, const char* src) {
+    char* d = dest;
+    for (; (uintptr_t)src & 7; src++, d++) {
+        if ((*d = *src) == '\0') return dest;
+    }
+    while (!HAS_ZERO(*(const word_t*)src)) {
+        *(unaligned_u64*)d = *(const word_t*)src;
+        src += 8;
+        d += 8;
+    }
+    while ((*d++ = *src++)); // copy until '\0'
+    return dest;
+}
+
+char* strncpy(char* dest, const char* src, size_t n) {
+    size_t len = strnlen(src, n);
+    memcpy(dest, src, len);
+    memset(dest + len, 0, n - len);
+    return dest;
+}
+
+char* strcat(char* dest, const char* src) {
+    strcpy(dest + strlen(dest), src);
+    return dest;
+}
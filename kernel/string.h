@@ -0,0 +1,17 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+void init_string();
+
+void* memcpy(void* dest, const void* src, size_t n);
+void* memset(void* ptr, unsigned char value, size_t n);
+void* memmove(void* dest, const void* src, size_t n);
+int memcmp(const void* ptr1, const void* ptr2, size_t n);
+
+size_t strlen(const char* s);
+size_t strnlen(const char* s, size_t max);
+int strcmp(const char* s1, const char* s2);
+char* strcpy(char* dest, const char* src);
+char* strncpy(char* dest, const char* src, size_t n);
+char* strcat(char* dest, const char* src);
@@ -1,9 +1,11 @@
 section .text
 global jump_to_user
 global context_switch
+extern kernel_unlock_all
 jump_to_user:
     cli                     ; Clear interrupts during switch
     mov rbp, 0
+    swapgs                  ; Park the kernel GS base, loading GS below clears the active one
     ; Set user data segments
     mov ax, 0x23            ; User data segment selector (RPL=3)
     mov ds, ax
@@ -20,6 +22,7 @@ jump_to_user:
 
 context_switch:
     mov rsp, rdi
+    call kernel_unlock_all  ; Only once off the old kernel stack, which may be freed after this
     pop r15
     pop r14
     pop r13
@@ -36,4 +39,8 @@ context_switch:
     pop rbx
     pop rax
     add rsp, 16
+    test qword [rsp + 8], 3
+    jz .to_kernel
+    swapgs
+.to_kernel:
     iretq
@@ -1,6 +1,7 @@
 #include "break.h"
 #include "scheduler.h"
 #include "../memory/paging.h"
+#include "../memory/vma.h"
 #include <stddef.h>
 
 void* set_brk(void* addr) {
@@ -9,7 +10,7 @@ void* set_brk(void* addr) {
     }
 
     // Enforce address is canonical and above initial break
-    if ((uintptr_t)addr >= 0x0000800000000000 && (uintptr_t)addr < 0xFFFF800000000000 && (uintptr_t)addr >= (uintptr_t)current_task->initial_brk) {
+    if ((uintptr_t)addr < 0x0000800000000000 && (uintptr_t)addr >= (uintptr_t)current_task->initial_brk) {
         // Valid address
     } else {
         return NULL;
@@ -19,27 +20,24 @@ void* set_brk(void* addr) {
         return NULL; // Current break is below initial break, should not happen
     }
 
-    // Check if the new break is below the current break
-    if (current_task->brk != NULL && addr < current_task->brk) {
-        // Get page difference and unmap pages
-        uintptr_t current_page = (uintptr_t)current_task->brk & ~0xFFF;
-        uintptr_t new_page = (uintptr_t)addr & ~0xFFF;
-        while (current_page > new_page) {
-            free_page((void*)current_page);
-            current_page -= 0x1000; // Move to the previous page
-        }
+    vma_t* heap = vma_find_start(current_task->vmas, (uintptr_t)current_task->initial_brk);
+    if (heap == NULL) {
+        return NULL;
     }
-
-    if (current_task->brk != NULL && addr > current_task->brk) {
-        // Get page difference and allocate pages
-        uintptr_t current_page = (uintptr_t)current_task->brk & ~0xFFF;
-        uintptr_t new_page = (uintptr_t)addr & ~0xFFF;
-        while (current_page < new_page) {
-            alloc_page(current_page, FLAGS_USER | FLAGS_RW);
-            current_page += 0x1000; // Move to the next page
-        }
+    uintptr_t new_end = PAGE_ALIGN((uintptr_t)addr);
+    if (heap->next && new_end > heap->next->start) {
+        return NULL; // Would run into the next mapping
+    }
+    if (new_end > heap->end && over_memory_limit((new_end - heap->end) / PAGE_SIZE)) {
+        return NULL; // Could never be filled without going past the memory limit
     }
 
+    // Shrinking unmaps whatever was faulted in above the new break
+    if (new_end < heap->end) unmap_range(new_end, heap->end - new_end);
+
+    // Growing only extends the heap, pages are allocated when first touched
+    heap->end = new_end;
+
     if (addr == NULL) {
         return current_task->brk; // Return current break if addr is NULL
     }
@@ -2,6 +2,7 @@
 #include "../mount.h"
 #include "../memory/mman.h"
 #include "../memory/paging.h"
+#include "../memory/vma.h"
 #include <stdint.h>
 
 int check_nx_support() {
@@ -56,7 +57,15 @@ int is_compatible_binary(const char* path) {
     return 1; // Compatible binary
 }
 
-void* load_elf(const char* path, void** brk) {
+// Copy part of a segment that doesn't cover a whole page into a private page
+static void load_segment_bytes(const char* path, uintptr_t start, uintptr_t end, size_t offset, uint64_t flags) {
+    if (!get_physical_address(start & PAGE_MASK)) {
+        alloc_zeroed_page(start & PAGE_MASK, flags | FLAGS_RW); // Read-only segments are write-protected once loaded
+    }
+    read_file(path, (uint8_t*)start, offset, end - start);
+}
+
+void* load_elf(const char* path, void** brk, vma_t** vmas) {
     if (!is_compatible_binary(path)) {
         return 0; // Not a compatible ELF binary
     }
@@ -71,24 +80,57 @@ void* load_elf(const char* path, void** brk) {
     // Read program headers
     read_file(path, (uint8_t*)&phdrs, ehdr.e_phoff, ehdr.e_phnum * sizeof(Elf64_Phdr));
 
+    cached_file_t* file = open_cached_file(path);
     void* break_addr = NULL;
     // Load segments into memory
     for (int i = 0; i < ehdr.e_phnum; i++) {
         if (phdrs[i].p_type == PT_LOAD) {
             // Allocate memory for the segment
             uint64_t flags = FLAGS_PRESENT | FLAGS_USER;
-            flags |= FLAGS_RW; // Proper write permission management requires mprotect(), which doesn't exist yet
+            if (phdrs[i].p_flags & PF_W) {
+                flags |= FLAGS_RW;
+            }
             if (!(phdrs[i].p_flags & PF_X) && check_nx_support()) {
                 flags |= FLAGS_NX; // Not executable
             }
-            void* segment_start = alloc_region(phdrs[i].p_vaddr, phdrs[i].p_memsz, flags);
-            if (!segment_start) {
-                return 0; // Failed to allocate memory for segment
+            uintptr_t file_end = phdrs[i].p_vaddr + phdrs[i].p_filesz;
+            uintptr_t mem_end = phdrs[i].p_vaddr + phdrs[i].p_memsz;
+            uintptr_t first_full = PAGE_ALIGN(phdrs[i].p_vaddr);
+            uintptr_t last_full = file_end & PAGE_MASK;
+            if (file && (phdrs[i].p_vaddr - phdrs[i].p_offset) % PAGE_SIZE == 0 && first_full < last_full) {
+                // Whole pages of the file image are shared with the page cache and faulted in on
+                // demand, the partial pages at either end are copied and the BSS is zero-filled
+                if (phdrs[i].p_vaddr < first_full) {
+                    vma_add(vmas, phdrs[i].p_vaddr, first_full, flags);
+                    load_segment_bytes(path, phdrs[i].p_vaddr, first_full, phdrs[i].p_offset, flags);
+                }
+                vma_t* image = vma_add(vmas, first_full, last_full, flags);
+                image->file = file;
+                image->offset = phdrs[i].p_offset + (first_full - phdrs[i].p_vaddr);
+                hold_cached_file(file);
+                if (last_full < mem_end) {
+                    vma_add(vmas, last_full, mem_end, flags);
+                }
+                if (last_full < file_end) {
+                    load_segment_bytes(path, last_full, file_end, phdrs[i].p_offset + (last_full - phdrs[i].p_vaddr), flags);
+                }
+            } else if (phdrs[i].p_filesz) {
+                // Segments that can't share page cache frames are copied, the BSS is zero-filled on first touch
+                vma_add(vmas, phdrs[i].p_vaddr, mem_end, flags);
+                // Mapped writable so it can be filled in, read-only segments are write-protected below
+                void* segment_start = alloc_region(phdrs[i].p_vaddr, phdrs[i].p_filesz, flags | FLAGS_RW);
+                if (!segment_start) {
+                    if (file) release_cached_file(file);
+                    return 0; // Failed to allocate memory for segment
+                }
+
+                // Read the segment data from the file
+                read_file(path, (uint8_t*)segment_start, phdrs[i].p_offset, phdrs[i].p_filesz);
+                memset((void*)file_end, 0, PAGE_ALIGN(file_end) - file_end); // BSS in the last file page
+            } else {
+                vma_add(vmas, phdrs[i].p_vaddr, mem_end, flags); // Nothing to load, zero-filled on first touch
             }
 
-            // Read the segment data from the file
-            read_file(path, (uint8_t*)segment_start, phdrs[i].p_offset, phdrs[i].p_filesz);
-
             // Update break address
             uint64_t segment_end = phdrs[i].p_vaddr + phdrs[i].p_memsz;
             if (!break_addr || segment_end > (uint64_t)break_addr) {
@@ -97,6 +139,29 @@ void* load_elf(const char* path, void** brk) {
         }
     }
 
-    if (brk) *brk = (void*)(((uintptr_t)break_addr / PAGE_SIZE + 1) * PAGE_SIZE); // Update the break address
+    // Write-protect read-only segments, except for pages shared with a writable one
+    for (int i = 0; i < ehdr.e_phnum; i++) {
+        if (phdrs[i].p_type != PT_LOAD || (phdrs[i].p_flags & PF_W) || !phdrs[i].p_filesz) continue;
+        uint64_t flags = FLAGS_USER;
+        if (!(phdrs[i].p_flags & PF_X) && check_nx_support()) {
+            flags |= FLAGS_NX;
+        }
+        for (uintptr_t page = phdrs[i].p_vaddr & PAGE_MASK; page < phdrs[i].p_vaddr + phdrs[i].p_filesz; page += PAGE_SIZE) {
+            int shared = 0;
+            for (int j = 0; j < ehdr.e_phnum; j++) {
+                if (phdrs[j].p_type == PT_LOAD && (phdrs[j].p_flags & PF_W) &&
+                    page < PAGE_ALIGN(phdrs[j].p_vaddr + phdrs[j].p_memsz) && page + PAGE_SIZE > (phdrs[j].p_vaddr & PAGE_MASK)) {
+                    shared = 1;
+                }
+            }
+            if (!shared) set_page_flags(page, flags);
+        }
+    }
+
+    if (file) release_cached_file(file); // The mapped segments keep their own references
+
+    void* initial_brk = (void*)(((uintptr_t)break_addr / PAGE_SIZE + 1) * PAGE_SIZE);
+    if (brk) *brk = initial_brk; // Update the break address
+    vma_add(vmas, (uintptr_t)initial_brk, (uintptr_t)initial_brk, FLAGS_USER | FLAGS_RW); // Heap, grown by set_brk()
     return (void*)ehdr.e_entry; // Successfully loaded ELF binary
 }
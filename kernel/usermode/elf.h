@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include "../memory/vma.h"
 
 // --- ELF Magic Number ---
 #define ELFMAG0 0x7f
@@ -87,6 +88,7 @@ typedef struct {
     uint64_t p_align;   // Segment alignment
 } Elf64_Phdr;
 
+int check_nx_support();
 int is_elf(const char *path);
 int is_compatible_binary(const char *path);
-void* load_elf(const char *path, void **brk);
+void* load_elf(const char *path, void **brk, vma_t** vmas);
@@ -5,20 +5,13 @@
 #include "../limine.h"
 #include "../drivers/ps2_keyboard.h"
 #include "../memory/mman.h"
+#include "../string.h"
 #include "../net/udp.h"
 #include "../drivers/serial.h"
 #include <stdint.h>
 
 extern volatile struct limine_framebuffer* framebuffer;
 
-static int strlen(const char* str) {
-    int len = 0;
-    while (str[len] != '\0') {
-        len++;
-    }
-    return len;
-}
-
 int open_file(const char *path, uint16_t flags) {
     if (flags & FLAG_CREATE) {
         create_file(path);
@@ -172,7 +165,15 @@ int seek(int fd, int64_t offset, int type) {
     return 0;
 }
 
-int read(int fd, void *buffer, size_t size) {
+// A blocking read of an empty tty waits for input and is then started over
+static int read_tty(tty_t* tty, void* buffer, size_t size, int block, iframe_t* iframe) {
+    uint64_t flags = irq_save();
+    if (block && !tty_input_ready(tty)) block_on(&tty->readers, iframe);
+    irq_restore(flags);
+    return tty_read(tty, buffer, size, 0);
+}
+
+int read(int fd, void *buffer, size_t size, iframe_t* iframe) {
     if (fd < 0 || fd >= MAX_FDS || current_task->fd_ptr_table[fd] == NULL) {
         return -1;
     }
@@ -182,7 +183,7 @@ int read(int fd, void *buffer, size_t size) {
         fd_entry->offset += bytes_read;
         return bytes_read;
     } else if (fd_entry->type == FD_TYPE_CONSOLE) {
-        return tty_read(&keyboard_tty, buffer, size, !(fd_entry->flags & FLAG_NONBLOCKING));
+        return read_tty(&keyboard_tty, buffer, size, !(fd_entry->flags & FLAG_NONBLOCKING), iframe);
     } else if (fd_entry->type == FD_TYPE_FRAMEBUFFER) {
         uint8_t* read_ptr = framebuffer->address + fd_entry->offset;
         size_t to_copy = size < (framebuffer->pitch * framebuffer->height - fd_entry->offset) ? size : (framebuffer->pitch * framebuffer->height - fd_entry->offset);
@@ -190,7 +191,7 @@ int read(int fd, void *buffer, size_t size) {
         fd_entry->offset += to_copy;
         return to_copy;
     } else if (fd_entry->type == FD_TYPE_SERIAL) {
-        return tty_read(serial_ttys + fd_entry->serial_port - 1, buffer, size, !(fd_entry->flags & FLAG_NONBLOCKING));
+        return read_tty(serial_ttys + fd_entry->serial_port - 1, buffer, size, !(fd_entry->flags & FLAG_NONBLOCKING), iframe);
     }
     return -1;
 }
@@ -2,6 +2,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include "../drivers/tty.h"
+#include "../idt.h"
 
 #define MAX_FDS 256
 #define FD_TYPE_FILE 1
@@ -26,7 +27,7 @@ typedef struct {
     int refcount;
 } fd_entry_t;
 
-int read(int fd, void* buffer, size_t size);
+int read(int fd, void* buffer, size_t size, iframe_t* iframe);
 int write(int fd, const void* buffer, size_t size);
 int seek(int fd, int64_t offset, int type);
 int open_file(const char* path, uint16_t flags);
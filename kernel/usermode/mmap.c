@@ -0,0 +1,98 @@
+#include "mmap.h"
+#include "scheduler.h"
+#include "elf.h"
+#include "fd.h"
+#include "../mount.h"
+#include "../memory/paging.h"
+#include "../memory/vma.h"
+#include <stddef.h>
+#include <stdint.h>
+
+static uint64_t prot_to_flags(int prot) {
+    if (prot == PROT_NONE) return 0;
+    uint64_t flags = FLAGS_USER;
+    if (prot & PROT_WRITE) flags |= FLAGS_RW;
+    if (!(prot & PROT_EXEC) && check_nx_support()) flags |= FLAGS_NX;
+    return flags;
+}
+
+static int valid_range(uintptr_t start, size_t length) {
+    return !(start & (PAGE_SIZE - 1)) && length && start + length <= USER_SPACE_END && start + length > start;
+}
+
+// The heap area starts out empty at initial_brk and is grown in place by set_brk, so nothing
+// else may take or remove any part of it, not even the address it starts at
+static int overlaps_heap(uintptr_t start, size_t length) {
+    vma_t* heap = vma_find_start(current_task->vmas, (uintptr_t)current_task->initial_brk);
+    if (heap == NULL) return 0;
+    return start < heap->end + (heap->end == heap->start) && start + length > heap->start;
+}
+
+void* mmap(void* addr, size_t length, int prot, int flags, int fd, size_t offset) {
+    if (length == 0 || (offset & (PAGE_SIZE - 1))) return MAP_FAILED;
+    if (!(flags & MAP_PRIVATE) || (flags & MAP_SHARED)) return MAP_FAILED; // Only private mappings are supported
+
+    if ((flags & MAP_ANONYMOUS) && over_memory_limit(PAGE_ALIGN(length) / PAGE_SIZE)) return MAP_FAILED; // Could never be filled within the limit
+
+    cached_file_t* file = NULL;
+    if (!(flags & MAP_ANONYMOUS)) {
+        if (fd < 0 || fd >= MAX_FDS || current_task->fd_ptr_table[fd] == NULL) return MAP_FAILED;
+        fd_entry_t* entry = current_task->fd_ptr_table[fd];
+        if (entry->type != FD_TYPE_FILE) return MAP_FAILED;
+        file = open_cached_file(entry->path);
+        if (file == NULL) return MAP_FAILED;
+    }
+
+    length = PAGE_ALIGN(length);
+    uintptr_t start = (uintptr_t)addr;
+    if (flags & MAP_FIXED) {
+        if (!valid_range(start, length) || overlaps_heap(start, length)) {
+            if (file) release_cached_file(file);
+            return MAP_FAILED;
+        }
+        munmap(addr, length);
+    } else if (!valid_range(start, length) || start < MMAP_BASE || vma_overlap(current_task->vmas, start, start + length)) {
+        // The hint can't be used, large mappings are 2 MiB aligned so allocators can carve aligned chunks
+        size_t align = length >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : PAGE_SIZE;
+        start = vma_find_gap(current_task->vmas, MMAP_BASE, USER_SPACE_END, length, align);
+        if (start == 0) {
+            if (file) release_cached_file(file);
+            return MAP_FAILED;
+        }
+    }
+
+    // Pages are faulted in on first touch, file pages come from the page cache
+    vma_t* vma = vma_add(&current_task->vmas, start, start + length, prot_to_flags(prot));
+    if (vma == NULL) {
+        if (file) release_cached_file(file);
+        return MAP_FAILED;
+    }
+    vma->file = file;
+    vma->offset = offset;
+    return (void*)start;
+}
+
+int munmap(void* addr, size_t length) {
+    uintptr_t start = (uintptr_t)addr;
+    length = PAGE_ALIGN(length);
+    if (!valid_range(start, length) || overlaps_heap(start, length)) return -1;
+
+    vma_remove(&current_task->vmas, start, start + length);
+    unmap_range(start, length);
+    return 0;
+}
+
+int mprotect(void* addr, size_t length, int prot) {
+    uintptr_t start = (uintptr_t)addr;
+    length = PAGE_ALIGN(length);
+    if (!valid_range(start, length)) return -1;
+    if (!vma_covers(current_task->vmas, start, start + length)) return -1;
+
+    uint64_t flags = prot_to_flags(prot);
+    for (vma_t* vma = vma_isolate(&current_task->vmas, start, start + length); vma && vma->start < start + length; vma = vma->next) {
+        vma->flags = flags;
+    }
+    // Pages that were already faulted in change in place
+    protect_range(start, length, flags);
+    return 0;
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define PROT_NONE 0x0
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC 0x4
+
+#define MAP_SHARED 0x01
+#define MAP_PRIVATE 0x02
+#define MAP_FIXED 0x10
+#define MAP_ANONYMOUS 0x20
+
+#define MAP_FAILED ((void*)-1)
+
+#define USER_SPACE_END 0x0000800000000000
+#define MMAP_BASE 0x20000000000 // Above the user stack
+
+void* mmap(void* addr, size_t length, int prot, int flags, int fd, size_t offset);
+int munmap(void* addr, size_t length);
+int mprotect(void* addr, size_t length, int prot);
@@ -4,103 +4,588 @@
 #include "../memory/mman.h"
 #include "elf.h"
 #include "../memory/paging.h"
+#include "../memory/kstack.h"
 #include "../panic.h"
 #include "../drivers/fpu.h"
+#include "../string.h"
+#include "../cpu.h"
+#include "../drivers/timer.h"
+#include "../io/lapic.h"
+#include "../smp.h"
 #include <stdint.h>
 
-task_t init_task = {.pid = 1, .next = &init_task, .time_slice = PROCESS_TICKS, .wd = "/"};
-task_t* current_task = &init_task;
+task_t init_task = {.pid = 1, .state = STATE_RUNNING, .weight = NICE_0_WEIGHT, .affinity = AFFINITY_ALL, .wd = "/"};
 int last_pid = 1;
-uint8_t scheduler_initialized = 0;
-int64_t ticks_remaining = PROCESS_TICKS;
-void* base_pml4;
+volatile uint8_t scheduler_initialized = 0;
+static int use_mwait = 0; // Idle CPUs wait in mwait on their idle flag instead of hlt
+
+// Weight of each nice level from -20 to 19. Nice 0 is 1024, and each level gets about 1.25
+// times the CPU time of the next one when both are ready.
+static const uint32_t nice_weights[NICE_MAX - NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+    9548, 7620, 6100, 4904, 3906, 3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423, 335, 272, 215, 172, 137,
+    110, 87, 70, 56, 45, 36, 29, 23, 18, 15,
+};
+
+#define WAKEUP_GRANULARITY 1000000 // Lead over the running task a woken one needs to preempt it
+#define SLEEPER_CREDIT (SCHED_LATENCY_NS / 2)
+#define STEAL_RETRY_NS SCHED_LATENCY_NS // How soon an idle CPU every other CPU refused asks again
+
+// Scheduler state of each CPU. Only the CPU itself touches its run heap, the fields other
+// CPUs write are changed with atomics.
+typedef struct {
+    task_t* run_heap;
+    task_t* volatile inbox; // Made ready here by other CPUs, moved to the run heap by the owner
+    task_t* outgoing;       // Leaving for another CPU, queued there once off its kernel stack
+    volatile uint64_t steal_requests; // Bit per idle CPU waiting to be handed a task from here
+    volatile int steal_pending;       // Asked another CPU for a task and had no answer yet
+    volatile uint64_t steal_refused;  // Bit per CPU that had nothing to hand over, not asked again
+    timer_t steal_retry;              // Forgets the refusals, armed when every CPU refused
+    int steal_retry_armed;
+    volatile int run_count;           // Tasks in the run heap and the inbox
+    volatile uint64_t run_weight;     // Sum of their weights
+    uint64_t min_vruntime; // Only moves forward, new and woken tasks are placed relative to it
+    uint64_t accounted;    // clock_ns() up to which running and idle time has been counted
+    task_t* fpu_owner;
+    int fpu_trapping;
+    cpu_stats_t stats;
+} cpu_sched_t;
+
+static cpu_sched_t cpu_sched[MAX_CPUS];
+
+// Lazy FPU switching: a task switch only sets CR0.TS, and the registers are saved and
+// reloaded by the #NM trap when the new task first touches them. Tasks that never use the
+// FPU never get a save area, and one that runs again before anyone else used the FPU finds
+// its registers still loaded. Those registers belong to one CPU, so a task whose state is
+// still in them is not moved to another CPU.
+static void switch_fpu(task_t* task) {
+    cpu_sched_t* sched = &cpu_sched[cpu_id()];
+    int trap = task != sched->fpu_owner;
+    if (trap == sched->fpu_trapping) return;
+    if (trap) {
+        fpu_disable();
+    } else {
+        fpu_enable();
+    }
+    sched->fpu_trapping = trap;
+}
+
+void handle_fpu_trap() {
+    cpu_sched_t* sched = &cpu_sched[cpu_id()];
+    fpu_enable();
+    sched->fpu_trapping = 0;
+    if (sched->fpu_owner == current_task) return;
+    if (sched->fpu_owner) save_fpu(sched->fpu_owner->fpu_state);
+    if (current_task->fpu_state == NULL) {
+        current_task->fpu_state = kmalloc(fpu_memory_size);
+        init_fpu_state(current_task->fpu_state);
+    }
+    restore_fpu(current_task->fpu_state);
+    sched->fpu_owner = current_task;
+}
+
+// Save the registers of a task holding this CPU's FPU, so that it can run on another CPU
+static void release_fpu(task_t* task) {
+    cpu_sched_t* sched = &cpu_sched[cpu_id()];
+    if (sched->fpu_owner != task) return;
+    fpu_enable();
+    save_fpu(task->fpu_state);
+    fpu_disable(); // Nobody owns the registers now, whoever uses them next traps
+    sched->fpu_trapping = 1;
+    sched->fpu_owner = NULL;
+}
+
+// Forget the FPU registers of a task, it starts from the initial state if it uses them again
+static void drop_fpu(task_t* task) {
+    if (cpu_sched[task->cpu].fpu_owner == task) cpu_sched[task->cpu].fpu_owner = NULL;
+    kfree(task->fpu_state);
+    task->fpu_state = NULL;
+}
+
+// Only tasks that can run are queued, in a skew heap per CPU keyed by virtual runtime, so
+// picking the next task never looks at blocked or exited ones. Sleeping tasks wait on a timer,
+// tasks waiting in waitpid are woken by the exit of the child they wait for. The queues are
+// also changed from timer interrupts, so they are only touched with interrupts disabled.
+//
+// Each CPU runs the ready task with the least virtual runtime: the time it ran, scaled down
+// by the weight of its nice value, so that a higher priority task is picked more often and
+// gets a longer slice. A task that slept is placed at most half a period behind the CPU's
+// minimum, so it runs soon after waking without banking the time it was away. Virtual
+// runtimes are relative to their CPU's minimum and are rebased when a task changes CPU.
+//
+// A task goes back to the CPU it last ran on, a new one to the least loaded CPU its affinity
+// allows. Only the owning CPU changes its run heap, the others push onto its inbox, a lock-free
+// stack it drains before picking. A CPU with nothing left asks the busiest one for a task
+// before it idles, and that CPU hands one over through the asker's inbox, or wakes it to ask
+// another. One that was refused by all of them asks again after a while. Tasks only change
+// CPU on the CPU they are queued on, and never while it still runs on their kernel stack:
+// one that is being switched away from waits in the outgoing slot until the CPU has left it.
+// The queues don't depend on the big kernel lock, the task fields other syscalls change,
+// such as the nice value or affinity, still do.
+static task_t* dead_tasks = NULL; // Reaped, freed by gc_tasks() once off their kernel stack
+
+static int vruntime_before(task_t* a, task_t* b) {
+    return (int64_t)(a->vruntime - b->vruntime) < 0;
+}
+
+static task_t* merge_heap(task_t* a, task_t* b) {
+    if (a == NULL) return b;
+    if (b == NULL) return a;
+    if (vruntime_before(b, a)) {
+        task_t* t = a;
+        a = b;
+        b = t;
+    }
+    // Merge down the right spine, then swap children to keep the heap balanced on average
+    task_t* merged = merge_heap(a->heap_right, b);
+    a->heap_right = a->heap_left;
+    a->heap_left = merged;
+    return a;
+}
+
+// The run heap functions are only called by the CPU owning the heap, with interrupts disabled.
+// Tasks are counted in run_count and run_weight when they are queued, inbox included.
+static void run_heap_insert(cpu_sched_t* sched, task_t* task) {
+    task->heap_left = NULL;
+    task->heap_right = NULL;
+    sched->run_heap = merge_heap(sched->run_heap, task);
+}
+
+// Unlink the first task of the run heap or one of its two children
+static task_t* run_heap_remove(cpu_sched_t* sched, task_t* task) {
+    task_t* rest = merge_heap(task->heap_left, task->heap_right);
+    if (sched->run_heap == task) {
+        sched->run_heap = rest;
+    } else if (sched->run_heap->heap_left == task) {
+        sched->run_heap->heap_left = rest;
+    } else {
+        sched->run_heap->heap_right = rest;
+    }
+    __atomic_sub_fetch(&sched->run_count, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&sched->run_weight, task->weight, __ATOMIC_RELAXED);
+    return task;
+}
+
+static void inbox_push(cpu_sched_t* sched, task_t* task) {
+    task_t* head = __atomic_load_n(&sched->inbox, __ATOMIC_RELAXED);
+    do {
+        task->queue_next = head;
+    } while (!__atomic_compare_exchange_n(&sched->inbox, &head, task, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Move the tasks other CPUs made ready here into the run heap
+static void drain_inbox(cpu_sched_t* sched) {
+    if (sched->inbox == NULL) return;
+    task_t* list = __atomic_exchange_n(&sched->inbox, NULL, __ATOMIC_ACQUIRE);
+    while (list) {
+        task_t* next = list->queue_next;
+        run_heap_insert(sched, list);
+        list = next;
+    }
+}
+
+static void update_min_vruntime(cpu_sched_t* sched, task_t* running) {
+    task_t* first = sched->run_heap;
+    if (running && (first == NULL || vruntime_before(running, first))) first = running;
+    if (first && (int64_t)(first->vruntime - sched->min_vruntime) > 0) sched->min_vruntime = first->vruntime;
+}
+
+static void move_vruntime(task_t* task, int from, int to) {
+    task->vruntime += cpu_sched[to].min_vruntime - cpu_sched[from].min_vruntime;
+}
+
+// Time the task runs before the next pick, its share of the scheduling period by weight
+static uint64_t time_slice(task_t* task) {
+    uint64_t slice = SCHED_LATENCY_NS * task->weight / (cpu_sched[task->cpu].run_weight + task->weight);
+    return slice < MIN_SLICE_NS ? MIN_SLICE_NS : slice;
+}
+
+// Charge the time since the last call to the running task, or to idle. A task that was
+// already queued again keeps its virtual runtime, it is the key of its place in the heap.
+static void account_time() {
+    cpu_t* cpu = this_cpu();
+    cpu_sched_t* sched = &cpu_sched[cpu->id];
+    uint64_t now = clock_ns();
+    uint64_t delta = now - sched->accounted;
+    sched->accounted = now;
+    task_t* task = cpu->task;
+    if (task == NULL) {
+        sched->stats.idle_ns += delta;
+        return;
+    }
+    sched->stats.busy_ns += delta;
+    if (task->state == STATE_READY) return;
+    task->vruntime += delta * NICE_0_WEIGHT / task->weight;
+    update_min_vruntime(sched, task->state == STATE_RUNNING ? task : NULL);
+}
+
+static int cpu_load(int cpu) {
+    return cpu_sched[cpu].run_count + (cpus[cpu].task != NULL);
+}
+
+static int cpu_allowed(task_t* task, int cpu) {
+    return (task->affinity >> cpu) & 1;
+}
+
+// Least loaded online CPU the task may run on
+static int pick_cpu(task_t* task) {
+    int best = -1;
+    int best_load = 0;
+    for (int cpu = 0; cpu < cpu_count; cpu++) {
+        if (!cpus[cpu].online || !cpu_allowed(task, cpu)) continue;
+        int load = cpu_load(cpu);
+        if (best < 0 || load < best_load) {
+            best = cpu;
+            best_load = load;
+        }
+    }
+    return best < 0 ? task->cpu : best;
+}
+
+// Wake an idle CPU that has work queued, or get another one to switch tasks. A CPU waiting
+// in mwait wakes up when its idle flag is cleared, without an IPI.
+static void kick_cpu(int cpu) {
+    if (cpu == cpu_id()) return;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // The task is queued before the idle flag is read, see idle()
+    if (cpus[cpu].idle && use_mwait) {
+        __atomic_store_n(&cpus[cpu].idle, 0, __ATOMIC_RELEASE);
+    } else if (cpus[cpu].idle || cpus[cpu].need_resched) {
+        lapic_send_ipi(cpus[cpu].lapic_id, RESCHEDULE_VECTOR);
+    }
+}
+
+// Queue a task on its CPU, in the run heap if that is this one and in its inbox otherwise
+static void queue_task(task_t* task) {
+    cpu_sched_t* sched = &cpu_sched[task->cpu];
+    __atomic_add_fetch(&sched->run_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sched->run_weight, task->weight, __ATOMIC_RELAXED);
+    if (task->cpu == cpu_id()) {
+        run_heap_insert(sched, task);
+    } else {
+        inbox_push(sched, task);
+    }
+
+    // A running task well ahead of this one is preempted
+    cpu_t* cpu = &cpus[task->cpu];
+    task_t* running = cpu->task;
+    if (running && running != task && (int64_t)(running->vruntime - task->vruntime) > WAKEUP_GRANULARITY) {
+        cpu->need_resched = 1;
+    }
+    kick_cpu(task->cpu);
+}
+
+// Also when the task's affinity no longer allows its CPU: that CPU moves it when it takes it,
+// as it is the one that knows when it is off the task's kernel stack and holds its registers
+static void make_ready(task_t* task) {
+    uint64_t flags = irq_save();
+    if (task == current_task) account_time();
+    task->state = STATE_READY;
+    task->block_reason = BLOCK_NONE;
+    queue_task(task);
+    irq_restore(flags);
+}
+
+// Queue a task taken off this CPU on one its affinity allows
+static void migrate_task(task_t* task) {
+    int from = task->cpu;
+    release_fpu(task);
+    task->cpu = pick_cpu(task);
+    move_vruntime(task, from, task->cpu);
+    queue_task(task);
+}
+
+// Queue the task left in the outgoing slot, once this CPU runs something else
+static void flush_outgoing(cpu_sched_t* sched) {
+    task_t* task = sched->outgoing;
+    if (task == NULL || task == this_cpu()->task) return;
+    sched->outgoing = NULL;
+    migrate_task(task);
+}
+
+// Send the task this CPU is running, and switching away from, to another CPU
+static void send_running_away(cpu_sched_t* sched, task_t* task) {
+    flush_outgoing(sched);
+    release_fpu(task);
+    sched->outgoing = task;
+}
+
+// Make a blocked task ready, no further back than half a period behind its CPU's minimum
+static void wake_task(task_t* task) {
+    uint64_t earliest = cpu_sched[task->cpu].min_vruntime - SLEEPER_CREDIT;
+    if ((int64_t)(task->vruntime - earliest) < 0) task->vruntime = earliest;
+    make_ready(task);
+}
+
+// Queue a task that has not run yet
+static void place_task(task_t* task) {
+    task->cpu = pick_cpu(task);
+    task->vruntime = cpu_sched[task->cpu].min_vruntime;
+    make_ready(task);
+}
+
+// A task to hand to another CPU: the first of the run heap or one of the two after it, that
+// is not running here and may run there. One whose registers are not loaded in this CPU's FPU
+// is preferred, those of the owner are saved if it is the only choice.
+static task_t* pick_stolen(cpu_sched_t* sched, int thief) {
+    task_t* first = sched->run_heap;
+    task_t* candidates[3] = {first, first ? first->heap_left : NULL, first ? first->heap_right : NULL};
+    task_t* owner = NULL;
+    for (int i = 0; i < 3; i++) {
+        task_t* task = candidates[i];
+        if (task == NULL || task == this_cpu()->task || !cpu_allowed(task, thief)) continue;
+        if (task != sched->fpu_owner) return task;
+        owner = task;
+    }
+    if (owner) release_fpu(owner);
+    return owner;
+}
+
+// Hand one queued task to each CPU that asked for one. An asker that gets nothing is woken
+// to ask another CPU, and doesn't ask this one again until it finds work or its retry timer
+// runs out.
+static void answer_steals(cpu_sched_t* sched) {
+    if (sched->steal_requests == 0) return;
+    uint64_t thieves = __atomic_exchange_n(&sched->steal_requests, 0, __ATOMIC_ACQUIRE);
+    drain_inbox(sched); // Tasks other CPUs queued here count as well
+    int cpu = cpu_id();
+    for (int thief = 0; thief < cpu_count; thief++) {
+        if (!(thieves & (1ull << thief))) continue;
+        task_t* task = pick_stolen(sched, thief);
+        if (task == NULL) __atomic_or_fetch(&cpu_sched[thief].steal_refused, 1ull << cpu, __ATOMIC_RELAXED);
+        // Cleared before the task is queued, so the thief can ask again as soon as it has run it
+        __atomic_store_n(&cpu_sched[thief].steal_pending, 0, __ATOMIC_RELEASE);
+        if (task == NULL) {
+            kick_cpu(thief);
+            continue;
+        }
+        run_heap_remove(sched, task);
+        move_vruntime(task, cpu, thief);
+        task->cpu = thief;
+        __atomic_add_fetch(&cpu_sched[thief].stats.steals, 1, __ATOMIC_RELAXED);
+        queue_task(task);
+    }
+}
+
+static void retry_steal(timer_t* timer) {
+    cpu_sched_t* sched = timer->data;
+    sched->steal_retry_armed = 0;
+    __atomic_store_n(&sched->steal_refused, 0, __ATOMIC_RELAXED);
+}
+
+// Ask the busiest other CPU with queued tasks for one. The IPI gets it to answer right away,
+// and the task arrives in this CPU's inbox.
+static void request_steal(cpu_sched_t* sched, int cpu) {
+    if (sched->steal_pending) return;
+    uint64_t refused = __atomic_load_n(&sched->steal_refused, __ATOMIC_RELAXED);
+    int victim = -1;
+    int victim_count = 0;
+    for (int other = 0; other < cpu_count; other++) {
+        int count = __atomic_load_n(&cpu_sched[other].run_count, __ATOMIC_RELAXED);
+        if (other != cpu && !(refused & (1ull << other)) && count > victim_count) {
+            victim = other;
+            victim_count = count;
+        }
+    }
+    if (victim < 0) {
+        // What every CPU refused may be stealable later, without anything waking this one
+        if (refused && !sched->steal_retry_armed) {
+            sched->steal_retry_armed = 1;
+            sched->steal_retry.callback = retry_steal;
+            sched->steal_retry.data = sched;
+            timer_arm(&sched->steal_retry, clock_ns() + STEAL_RETRY_NS);
+        }
+        return;
+    }
+    sched->steal_pending = 1;
+    __atomic_or_fetch(&cpu_sched[victim].steal_requests, 1ull << cpu, __ATOMIC_RELEASE);
+    lapic_send_ipi(cpus[victim].lapic_id, RESCHEDULE_VECTOR);
+}
+
+static task_t* take_ready() {
+    int cpu = cpu_id();
+    cpu_sched_t* sched = &cpu_sched[cpu];
+    flush_outgoing(sched);
+    drain_inbox(sched);
+    while (sched->run_heap) {
+        task_t* task = run_heap_remove(sched, sched->run_heap);
+        if (cpu_allowed(task, cpu)) {
+            __atomic_store_n(&sched->steal_refused, 0, __ATOMIC_RELAXED);
+            update_min_vruntime(sched, task);
+            answer_steals(sched); // What is left can be spared
+            return task;
+        }
+        // Its affinity changed while it was queued
+        if (task == this_cpu()->task) {
+            send_running_away(sched, task);
+        } else {
+            migrate_task(task);
+        }
+    }
+    answer_steals(sched); // Nothing to give, but the askers may ask elsewhere
+    request_steal(sched, cpu);
+    return NULL;
+}
+
+static void wake_sleeper(timer_t* timer) {
+    wake_task(timer->data);
+}
 
 void gc_tasks() {
-    task_t* p = &init_task;
-    task_t* t = init_task.next;
-    while (t != &init_task) {
-        if (t->state == STATE_DELETED) {
-            free_page_tables(t->cr3);
-            kfree(t->kernel_stack - 4096 * 32);
-            kfree(t->fpu_state);
-            p->next = t->next;
-            if (t->parent->child == t) {
-                t->parent->child = t->next_sibling;
-            } else {
-                task_t* s = t->parent->child;
-                while (s->next_sibling) {
-                    if (s->next_sibling == t) {
-                        s->next_sibling = t->next_sibling;
-                        break;
-                    }
-                    s = s->next_sibling;
+    while (dead_tasks) {
+        task_t* t = dead_tasks;
+        dead_tasks = t->queue_next;
+        free_page_tables(t->cr3);
+        vma_free_all(t->vmas);
+        free_kernel_stack(t->kernel_stack);
+        drop_fpu(t);
+        if (t->parent->child == t) {
+            t->parent->child = t->next_sibling;
+        } else {
+            task_t* s = t->parent->child;
+            while (s->next_sibling) {
+                if (s->next_sibling == t) {
+                    s->next_sibling = t->next_sibling;
+                    break;
                 }
+                s = s->next_sibling;
             }
-            task_t* next = t->next;
-            kfree(t);
-            t = next;
-            continue;
         }
-        p = t;
-        t = p->next;
+        kfree(t);
     }
 }
 
 void run_init(char* path) {
-    asm volatile(
-        "mov %%cr3, %0"
-        : "=r"(base_pml4)
-    );
-    init_task.cr3 = clone_page_tables(base_pml4);
-    asm volatile(
-        "mov %0, %%cr3"
-        :: "r"(init_task.cr3)
-    );
-    change_pml4(init_task.cr3);
-    void* addr = load_elf(path, &init_task.initial_brk);
+    current_task = &init_task;
+    init_task.cr3 = create_address_space();
+    switch_address_space(init_task.cr3, &init_task.pcid, &init_task.mm);
+    void* addr = load_elf(path, &init_task.initial_brk, &init_task.vmas);
     if (!addr) {
         panic("Failed to load init binary: %s", path);
     }
     init_task.brk = init_task.initial_brk;
-    alloc_region(0x10000000000, 4096 * 128, FLAGS_PRESENT | FLAGS_RW | FLAGS_USER);
-    void* kstack = (char*)kmalloc(4096 * 32) + 4096 * 32;
+    vma_add(&init_task.vmas, USER_STACK_BASE, USER_STACK_BASE + USER_STACK_SIZE, FLAGS_RW | FLAGS_USER);
+    void* kstack = alloc_kernel_stack();
     init_task.kernel_stack = kstack;
     set_rsp0((uint64_t)kstack);
-    init_task.fpu_state = kmalloc(fpu_memory_size);
-    current_task = &init_task;
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    use_mwait = (ecx >> 3) & 1; // MONITOR/MWAIT
+    cpu_sched[0].accounted = clock_ns();
+    timer_set_preempt(clock_ns() + time_slice(&init_task));
     scheduler_initialized = 1;
-    jump_to_user(addr, (char*)0x10000000000 + 4096 * 128 - 16);
+    switch_fpu(&init_task);
+    jump_to_user(addr, (char*)USER_STACK_BASE + USER_STACK_SIZE - 16);
+}
+
+// Make next current and enter it, dropping the big kernel lock on the way
+static void __attribute__((noreturn)) switch_to(task_t* next) {
+    cpu_t* cpu = this_cpu();
+    account_time();
+    task_t* previous = cpu->task;
+    cpu->task = next;
+    cpu->need_resched = 0;
+    next->state = STATE_RUNNING;
+    next->cpu = cpu->id;
+    timer_set_preempt(clock_ns() + time_slice(next));
+    cpu_sched[cpu->id].stats.switches++;
+    if (previous == NULL || (previous->state != STATE_ZOMBIE && previous->state != STATE_DELETED)) {
+        gc_tasks(); // An exiting task is still running on its kernel stack
+    }
+    switch_address_space(next->cr3, &next->pcid, &next->mm);
+    switch_fpu(next);
+    set_rsp0((uint64_t)next->kernel_stack);
+    next->iframe->rflags |= 0x200;
+    context_switch(next->iframe);
+}
+
+// The idle task of each CPU, only entered when nothing is ready. It runs on the CPU's own
+// stack in the kernel address space, so that the task it left is not used anymore and can be
+// freed by another CPU, and its time counts as idle. It is first spent clearing free frames,
+// then waiting with the lock dropped until an interrupt, a reschedule IPI or, in mwait, a
+// write to the CPU's idle flag.
+static void __attribute__((noreturn, used)) idle() {
+    cpu_t* cpu = this_cpu();
+    cpu_stats_t* stats = &cpu_sched[cpu->id].stats;
+    int pool_full = 0;
+    for (;;) {
+        task_t* next = take_ready();
+        if (next) switch_to(next);
+        if (!pool_full) {
+            asm volatile("sti");
+            pool_full = refill_zero_pool(ZERO_POOL_REFILL);
+            asm volatile("cli");
+            continue;
+        }
+        cpu->idle = 1;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (cpu_sched[cpu->id].inbox) {
+            cpu->idle = 0; // Queued before the flag was set, so nobody kicks this CPU for it
+            continue;
+        }
+        stats->halts++;
+        kernel_unlock_all();
+        if (use_mwait) {
+            // Armed before the last look at the flag, so a kick in between is not missed
+            asm volatile("monitor" :: "a"(&cpu->idle), "c"(0), "d"(0));
+            if (cpu->idle) asm volatile("sti; mwait; cli" :: "a"(0), "c"(0) : "memory"); // C1
+        } else {
+            asm volatile("sti; hlt; cli" ::: "memory"); // sti holds off interrupts until hlt
+        }
+        kernel_lock();
+        cpu->idle = 0;
+    }
+}
+
+// Leave the current task, already queued, blocked or exited, for the next ready one.
+// Interrupts stay disabled until context_switch() enters the new task.
+static void __attribute__((noreturn)) schedule() {
+    task_t* next = take_ready();
+    if (next) switch_to(next);
+    enter_scheduler();
+}
+
+// Idle until there is something to run, also how the other CPUs start scheduling
+void __attribute__((noreturn)) enter_scheduler() {
+    cpu_t* cpu = this_cpu();
+    switch_to_kernel_space();
+    account_time();
+    cpu->task = NULL;
+    cpu->need_resched = 0;
+    timer_set_preempt(0);
+    asm volatile("mov %0, %%rsp; xor %%ebp, %%ebp; call idle" :: "r"(cpu->idle_stack) : "memory");
+    __builtin_unreachable();
 }
 
 void run_next(iframe_t* iframe) {
     if (!scheduler_initialized) return;
+    irq_save();
     current_task->iframe = iframe;
-    save_fpu(current_task->fpu_state);
-    current_task->state = STATE_READY;
-    do {
-        current_task = current_task->next;
-    } while (current_task->state != STATE_READY);
-    current_task->state = STATE_RUNNING;
-    ticks_remaining = current_task->time_slice;
-    gc_tasks();
-    asm volatile(
-        "mov %0, %%cr3"
-        :: "r"(current_task->cr3)
-    );
-    change_pml4(current_task->cr3);
-    restore_fpu(current_task->fpu_state);
-    set_rsp0((uint64_t)current_task->kernel_stack);
-    current_task->iframe->rflags |= 0x200;
-    context_switch(current_task->iframe);
+    make_ready(current_task);
+    schedule();
+}
+
+// On the way back to user mode, after a syscall or an interrupt
+void preempt_check(iframe_t* iframe) {
+    if (!scheduler_initialized) return;
+    cpu_sched_t* sched = &cpu_sched[cpu_id()];
+    flush_outgoing(sched);
+    answer_steals(sched);
+    if (this_cpu()->need_resched && iframe->cs == USER_CS) run_next(iframe);
 }
 
+static void wake_waiting_parent(task_t* parent);
+
 void exit(int ret) {
     if (current_task == &init_task) panic("Init process exited!");
+    irq_save();
     current_task->state = STATE_ZOMBIE;
     current_task->return_code = ret;
+    drop_fpu(current_task);
 
     // Reparent children
     task_t* c = current_task->child;
+    current_task->child = NULL;
     while (c) {
         task_t* next = c->next_sibling;
         c->parent = &init_task;
@@ -109,20 +594,17 @@ void exit(int ret) {
         c = next;
     }
 
-    // Run next task
-    do {
-        current_task = current_task->next;
-    } while (current_task->state != STATE_READY);
-    current_task->state = STATE_RUNNING;
-    asm volatile(
-        "mov %0, %%cr3"
-        :: "r"(current_task->cr3)
-    );
-    change_pml4(current_task->cr3);
-    restore_fpu(current_task->fpu_state);
-    set_rsp0((uint64_t)current_task->kernel_stack);
-    current_task->iframe->rflags |= 0x200;
-    context_switch(current_task->iframe);
+    wake_waiting_parent(current_task->parent);
+    wake_waiting_parent(&init_task); // For zombies among the reparented children
+    schedule();
+}
+
+// exit() for a fault taken on the page fault handler's exception stack. The task entered from
+// user mode, so its kernel stack is unused: exit() runs there, where a fault it takes while
+// writing to the parent can't reuse the exception stack under it.
+void __attribute__((noreturn)) exit_from_fault(int ret) {
+    asm volatile("mov %0, %%rsp; xor %%ebp, %%ebp; call exit" :: "r"(current_task->kernel_stack), "D"((int64_t)ret) : "memory");
+    __builtin_unreachable();
 }
 
 int fork(iframe_t* iframe) {
@@ -132,13 +614,20 @@ int fork(iframe_t* iframe) {
     *new_task = *current_task;
     new_task->state = STATE_READY;
     new_task->cr3 = clone_page_tables(current_task->cr3);
-    void* kstack = (char*)kmalloc(4096 * 32) + 4096 * 32;
+    new_task->mm.tlb_generation = 0; // A new address space, it must not share the parent's
+    new_task->vmas = vma_clone(current_task->vmas);
+    memset(&new_task->faults, 0, sizeof(fault_stats_t));
+    void* kstack = alloc_kernel_stack();
     iframe_t* new_iframe = kstack - sizeof(iframe_t);
     *new_iframe = *current_task->iframe;
     new_task->kernel_stack = kstack;
     new_task->iframe = new_iframe;
-    new_task->fpu_state = kmalloc(fpu_memory_size);
-    current_task->next = new_task;
+    new_task->fpu_state = NULL;
+    if (current_task->fpu_state) {
+        if (cpu_sched[cpu_id()].fpu_owner == current_task) save_fpu(current_task->fpu_state);
+        new_task->fpu_state = kmalloc(fpu_memory_size);
+        memcpy(new_task->fpu_state, current_task->fpu_state, fpu_memory_size);
+    }
     new_task->next_sibling = current_task->child;
     new_task->child = NULL;
     new_task->pid = ++last_pid;
@@ -146,99 +635,149 @@ int fork(iframe_t* iframe) {
     current_task->child = new_task;
     current_task->iframe->rax = new_task->pid;
     new_task->iframe->rax = 0;
+    place_task(new_task);
     return new_task->pid;
 }
 
-static int strlen(char* s) {
-    int len = 0;
-    while (*s++) {
-        len++;
-    }
-    return len;
-}
+// Arguments of a new program, copied to kernel memory before the old address space goes away
+typedef struct {
+    char* path;
+    char** argv;
+    int argc;
+    size_t stack_bytes; // Room they take on the user stack
+} program_args_t;
 
-int add_task(char* path, char** argv, task_t* parent, int pid, iframe_t* iframe) {
-    // Copy path to kernel memory
+static void copy_program_args(program_args_t* args, char* path, char** argv) {
     size_t path_len = strlen(path) + 1;
-    char kpath[path_len];
-    memcpy(kpath, path, path_len);
+    args->path = kmalloc(path_len);
+    memcpy(args->path, path, path_len);
 
-    // Count arguments
-    int argc = 0;
-    while (argv[argc]) argc++;
+    args->argc = 0;
+    while (argv[args->argc]) args->argc++;
 
-    // Copy argv strings to kernel memory
-    char* kargv[sizeof(char*) * (argc + 1)];
-    for (int i = 0; i < argc; i++) {
+    args->argv = kmalloc(sizeof(char*) * (args->argc + 1));
+    args->stack_bytes = (args->argc + 2) * sizeof(uintptr_t); // argv pointers, NULL and argc
+    for (int i = 0; i < args->argc; i++) {
         size_t len = strlen(argv[i]) + 1;
-        kargv[i] = kmalloc(len);
-        memcpy(kargv[i], argv[i], len);
+        args->argv[i] = kmalloc(len);
+        memcpy(args->argv[i], argv[i], len);
+        args->stack_bytes += len;
     }
-    kargv[argc] = NULL;
+    args->argv[args->argc] = NULL;
+}
 
-    task_t* new_task = kmalloc(sizeof(task_t));
-    *new_task = *parent;
-    new_task->state = STATE_READY;
-    new_task->cr3 = clone_page_tables(base_pml4);
+static void free_program_args(program_args_t* args) {
+    for (int i = 0; i < args->argc; i++) kfree(args->argv[i]);
+    kfree(args->argv);
+    kfree(args->path);
+}
+
+// Build a fresh address space for the program and load it, leaving it active. On success the
+// task's address space fields are replaced and the entry point and initial stack pointer are
+// returned, on failure the current task's address space is active again and nothing changed.
+static void* load_program(task_t* task, program_args_t* args, uintptr_t* rsp) {
+    void* cr3 = create_address_space();
+    uint16_t pcid = 0;
+    mm_counters_t mm = {.resident = 0, .limit = task->mm.limit};
+    vma_t* vmas = NULL;
+    void* initial_brk;
 
-    // Switch to the new page table
-    asm volatile("mov %0, %%cr3" :: "r"(new_task->cr3));
-    change_pml4(new_task->cr3);
+    switch_address_space(cr3, &pcid, &mm);
 
-    // Load the ELF
-    void* entry = load_elf(kpath, &new_task->initial_brk);
+    void* entry = load_elf(args->path, &initial_brk, &vmas);
     if (!entry) {
-        // Restore old page table
-        asm volatile("mov %0, %%cr3" :: "r"(current_task->cr3));
-        change_pml4(current_task->cr3);
-        return -1;
+        switch_address_space(current_task->cr3, &current_task->pcid, &current_task->mm);
+        vma_free_all(vmas);
+        free_page_tables(cr3);
+        return NULL;
     }
+    task->cr3 = cr3;
+    task->pcid = pcid;
+    task->vmas = vmas;
+    task->initial_brk = initial_brk;
+    task->brk = initial_brk;
 
-    // Allocate user stack
-    alloc_region(0x10000000000, 4096 * 128, FLAGS_PRESENT | FLAGS_RW | FLAGS_USER);
-    uintptr_t user_stack = 0x10000000000 + 4096 * 128;
+    // Reserve the user stack, only the pages holding the arguments are mapped now
+    vma_t* stack = vma_add(&task->vmas, USER_STACK_BASE, USER_STACK_BASE + USER_STACK_SIZE, FLAGS_RW | FLAGS_USER);
+    uintptr_t user_stack = USER_STACK_BASE + USER_STACK_SIZE;
+    vma_populate(stack, user_stack - args->stack_bytes, user_stack);
 
     // Temporary array for string addresses on user stack
-    uintptr_t argv_ptrs[sizeof(uintptr_t) * argc];
+    uintptr_t argv_ptrs[args->argc + 1];
 
     // Copy argv strings onto user stack
-    for (int i = argc - 1; i >= 0; i--) {
-        size_t len = strlen(kargv[i]) + 1;
+    for (int i = args->argc - 1; i >= 0; i--) {
+        size_t len = strlen(args->argv[i]) + 1;
         user_stack -= len;
-        memcpy((void*)user_stack, kargv[i], len);
+        memcpy((void*)user_stack, args->argv[i], len);
         argv_ptrs[i] = user_stack;
-        kfree(kargv[i]);
     }
 
     // Push argv pointers
-    for (int i = argc; i >= 0; i--) {
+    for (int i = args->argc; i >= 0; i--) {
         user_stack -= sizeof(uintptr_t);
-        *(uintptr_t*)user_stack = (i < argc) ? argv_ptrs[i] : 0;
+        *(uintptr_t*)user_stack = (i < args->argc) ? argv_ptrs[i] : 0;
     }
-    uintptr_t argv_start = user_stack;
 
     // Push argc
     user_stack -= 8;
-    *(uint64_t*)user_stack = argc;
+    *(uint64_t*)user_stack = args->argc;
+
+    task->mm = mm;
+    switch_address_space(cr3, &task->pcid, &task->mm); // Only moves the counters off this stack frame
+    *rsp = user_stack;
+    return entry;
+}
+
+// Registers a program starts with: only the entry point, stack and selectors, nothing left
+// over from the task that created or replaced it
+static void init_user_iframe(iframe_t* iframe, void* entry, uintptr_t user_stack) {
+    uint64_t cs = iframe->cs;
+    uint64_t ss = iframe->ss;
+    memset(iframe, 0, sizeof(iframe_t));
+    iframe->rip = (uint64_t)entry;
+    iframe->cs = cs;
+    iframe->rflags = 0x202; // Interrupts enabled
+    iframe->rsp = user_stack;
+    iframe->ss = ss;
+}
+
+int add_task(char* path, char** argv, task_t* parent, int pid, iframe_t* iframe) {
+    program_args_t args;
+    copy_program_args(&args, path, argv);
+
+    task_t* new_task = kmalloc(sizeof(task_t));
+    *new_task = *parent;
+    new_task->state = STATE_READY;
+    memset(&new_task->faults, 0, sizeof(fault_stats_t));
+
+    uintptr_t user_stack;
+    void* entry = load_program(new_task, &args, &user_stack);
+    free_program_args(&args);
+    if (!entry) {
+        kfree(new_task);
+        return -1;
+    }
+
+    // Back to the parent, the child's address space is only entered when it first runs
+    switch_address_space(current_task->cr3, &current_task->pcid, &current_task->mm);
 
     // Setup kernel stack and iframe
-    void* kstack = (char*)kmalloc(4096 * 32) + 4096 * 32;
+    void* kstack = alloc_kernel_stack();
     iframe_t* new_iframe = kstack - sizeof(iframe_t);
     *new_iframe = *iframe;
-    new_iframe->rsp = user_stack;
-    new_iframe->rip = (uint64_t)entry;
+    init_user_iframe(new_iframe, entry, user_stack);
     new_task->kernel_stack = kstack;
     new_task->iframe = new_iframe;
-    new_task->fpu_state = kmalloc(fpu_memory_size);
+    new_task->fpu_state = NULL;
 
     // Link task tree
-    new_task->next = parent->next;
-    parent->next = new_task;
     new_task->next_sibling = parent->child;
     new_task->child = NULL;
     new_task->pid = pid;
     new_task->parent = parent;
     parent->child = new_task;
+    place_task(new_task);
 
     return pid;
 }
@@ -250,48 +789,42 @@ int spawn(char* path, char** argv, iframe_t* iframe) {
     return add_task(path, argv, current_task, ++last_pid, iframe);
 }
 
+// Replace the program of the current task in place. The task keeps its PID, file descriptors,
+// children and kernel stack, and the syscall returns straight into the new program.
 int execv(char *path, char **argv, iframe_t *iframe) {
-    int res = add_task(path, argv, current_task->parent, current_task->pid, iframe);
-    if (res != current_task->pid) {
-        return res;
-    }
-    current_task->state = STATE_DELETED;
-    do {
-        current_task = current_task->next;
-    } while (current_task->state != STATE_READY);
-    current_task->state = STATE_RUNNING;
-    ticks_remaining = current_task->time_slice;
-    asm volatile(
-        "mov %0, %%cr3"
-        :: "r"(current_task->cr3)
-    );
-    change_pml4(current_task->cr3);
-    restore_fpu(current_task->fpu_state);
-    set_rsp0((uint64_t)current_task->kernel_stack);
-    current_task->iframe->rflags |= 0x200;
-    context_switch(current_task->iframe);
+    program_args_t args;
+    copy_program_args(&args, path, argv);
+
+    void* old_cr3 = current_task->cr3;
+    vma_t* old_vmas = current_task->vmas;
+    uintptr_t user_stack;
+    void* entry = load_program(current_task, &args, &user_stack);
+    free_program_args(&args);
+    if (!entry) return -1;
+
+    free_page_tables(old_cr3);
+    vma_free_all(old_vmas);
+
+    init_user_iframe(iframe, entry, user_stack);
+    drop_fpu(current_task);
+    switch_fpu(current_task);
     return 0;
 }
 
 void sleep(uint64_t ms, iframe_t *iframe) {
-    if (ms == 0) return;
+    sleep_ns(ms * 1000000, iframe);
+}
+
+void sleep_ns(uint64_t ns, iframe_t* iframe) {
+    if (ns == 0) return;
+    irq_save();
+    current_task->iframe = iframe;
     current_task->state = STATE_BLOCKED;
     current_task->block_reason = BLOCK_DELAY;
-    current_task->blocked_ticks = ms;
-    do {
-        current_task = current_task->next;
-    } while (current_task->state != STATE_READY);
-    current_task->state = STATE_RUNNING;
-    ticks_remaining = current_task->time_slice;
-    asm volatile(
-        "mov %0, %%cr3"
-        :: "r"(current_task->cr3)
-    );
-    change_pml4(current_task->cr3);
-    restore_fpu(current_task->fpu_state);
-    set_rsp0((uint64_t)current_task->kernel_stack);
-    current_task->iframe->rflags |= 0x200;
-    context_switch(current_task->iframe);
+    current_task->sleep_timer.callback = wake_sleeper;
+    current_task->sleep_timer.data = current_task;
+    timer_arm(&current_task->sleep_timer, clock_ns() + ns);
+    schedule();
 }
 
 task_t* get_child(task_t* task, int pid) {
@@ -313,117 +846,105 @@ task_t* get_first_zombie(task_t* task) {
     return NULL;
 }
 
+// Write a waiting task's exit status into its own address space, directly through the HHDM
+// when the page is present and private. Otherwise the task is made current for the duration
+// so that a copy-on-write or demand-zero fault on wstatus resolves against it.
+static void store_wstatus(task_t* task, int status) {
+    if (!task->wstatus) return;
+    uintptr_t address = (uintptr_t)task->wstatus;
+    if ((address & (PAGE_SIZE - 1)) <= PAGE_SIZE - sizeof(int)) {
+        int* target = writable_user_address(task->cr3, address);
+        if (target) {
+            *target = status;
+            return;
+        }
+    }
+    // Resolved in the waiting task's address space, without taking a fault
+    task_t* running = current_task;
+    current_task = task;
+    switch_address_space(task->cr3, &task->pcid, &task->mm);
+    if (access_user_range(address, sizeof(int), 1) == 0) *task->wstatus = status;
+    current_task = running;
+    switch_address_space(running->cr3, &running->pcid, &running->mm);
+}
+
+// Move a zombie child to the dead list, its parent has collected the exit status
+static void reap(task_t* child) {
+    child->state = STATE_DELETED;
+    child->queue_next = dead_tasks;
+    dead_tasks = child;
+}
+
+// If parent is blocked in waitpid() on a child that is now a zombie, reap it and wake parent
+static void wake_waiting_parent(task_t* parent) {
+    if (parent->state != STATE_BLOCKED || parent->block_reason != BLOCK_WAITPID) return;
+    task_t* child = parent->blocked_process;
+    if (child == NULL) {
+        child = get_first_zombie(parent);
+    } else if (child->state != STATE_ZOMBIE) {
+        child = NULL;
+    }
+    if (child == NULL) return;
+
+    store_wstatus(parent, child->return_code);
+    parent->iframe->rax = child->pid;
+    parent->blocked_process = NULL;
+    reap(child);
+    wake_task(parent);
+}
+
 int waitpid(int pid, int* wstatus, int options, iframe_t* iframe) {
+    task_t* child = NULL;
     if (pid > 0) {
-        task_t* child = get_child(current_task, pid);
+        child = get_child(current_task, pid);
         if (child == NULL) return -1;
         if (child->state == STATE_ZOMBIE) {
             if (wstatus) *wstatus = child->return_code;
-            child->state = STATE_DELETED;
+            reap(child);
             return pid;
         }
-        if (options & WNOHANG) return -1;
-        current_task->state = STATE_BLOCKED;
-        current_task->block_reason = BLOCK_WAITPID;
-        current_task->blocked_process = child;
-        current_task->wstatus = wstatus;
-        do {
-            current_task = current_task->next;
-        } while (current_task->state != STATE_READY);
-        current_task->state = STATE_RUNNING;
-        ticks_remaining = current_task->time_slice;
-        asm volatile(
-            "mov %0, %%cr3"
-            :: "r"(current_task->cr3)
-        );
-        change_pml4(current_task->cr3);
-        restore_fpu(current_task->fpu_state);
-        set_rsp0((uint64_t)current_task->kernel_stack);
-        current_task->iframe->rflags |= 0x200;
-        context_switch(current_task->iframe);
     } else {
-        task_t* child = get_first_zombie(current_task);
-        if (child != NULL) {
-            if (wstatus) *wstatus = child->return_code;
-            child->state = STATE_BLOCKED;
-            return child->pid;
+        task_t* zombie = get_first_zombie(current_task);
+        if (zombie != NULL) {
+            if (wstatus) *wstatus = zombie->return_code;
+            reap(zombie);
+            return zombie->pid;
         }
-        if (options & WNOHANG) return -1;
-        current_task->state = STATE_BLOCKED;
-        current_task->block_reason = BLOCK_WAITPID;
-        current_task->blocked_process = NULL;
-        current_task->wstatus = wstatus;
-        do {
-            current_task = current_task->next;
-        } while (current_task->state != STATE_READY);
-        current_task->state = STATE_RUNNING;
-        ticks_remaining = current_task->time_slice;
-        asm volatile(
-            "mov %0, %%cr3"
-            :: "r"(current_task->cr3)
-        );
-        change_pml4(current_task->cr3);
-        restore_fpu(current_task->fpu_state);
-        set_rsp0((uint64_t)current_task->kernel_stack);
-        current_task->iframe->rflags |= 0x200;
-        context_switch(current_task->iframe);
-    }
-
-    return -1;
-}
-
-void check_blocked_tasks(int reduce_ticks) {
-    task_t* task = &init_task;
-    do {
-        if (task->state == STATE_BLOCKED) {
-            if (task->block_reason == BLOCK_DELAY) {
-                if (reduce_ticks) task->blocked_ticks--;
-                if (task->blocked_ticks == 0) {
-                    task->state = STATE_READY;
-                    task->block_reason = BLOCK_NONE;
-                }
-            } else if (task->block_reason == BLOCK_WAITPID) {
-                if (task->blocked_process != NULL) {
-                    if (task->blocked_process->state == STATE_ZOMBIE) {
-                        asm volatile(
-                            "mov %0, %%cr3"
-                            :: "r"(task->cr3)
-                        );
-                        if (task->wstatus) *task->wstatus = task->blocked_process->return_code;
-                        asm volatile(
-                            "mov %0, %%cr3"
-                            :: "r"(current_task->cr3)
-                        );
-                        task->blocked_process->state = STATE_DELETED;
-                        task->state = STATE_READY;
-                        task->block_reason = BLOCK_NONE;
-                        task->iframe->rax = task->blocked_process->pid;
-                        task->blocked_process = NULL;
-                    }
-                } else {
-                    task_t* blocked = get_first_zombie(task);
-                    if (blocked == NULL) {
-                        task = task->next;
-                        continue;
-                    }
-                    asm volatile(
-                        "mov %0, %%cr3"
-                        :: "r"(task->cr3)
-                    );
-                    if (task->wstatus) *task->wstatus = blocked->return_code;
-                    asm volatile(
-                        "mov %0, %%cr3"
-                        :: "r"(current_task->cr3)
-                    );
-                    blocked->state = STATE_DELETED;
-                    task->state = STATE_READY;
-                    task->block_reason = BLOCK_NONE;
-                    task->iframe->rax = blocked->pid;
-                }
-            }
-        }
-        task = task->next;
-    } while (task != &init_task);
+    }
+    if (options & WNOHANG) return -1;
+
+    // Woken by the exit of the child, see wake_waiting_parent()
+    irq_save();
+    current_task->iframe = iframe;
+    current_task->state = STATE_BLOCKED;
+    current_task->block_reason = BLOCK_WAITPID;
+    current_task->blocked_process = child;
+    current_task->wstatus = wstatus;
+    schedule();
+}
+
+// Block the calling task, in a syscall, until wake_all() on the queue. The syscall is then
+// started over: the task resumes at its int 0x80 with the registers it made the call with.
+void block_on(task_t** queue, iframe_t* iframe) {
+    irq_save();
+    iframe->rip -= 2; // int 0x80
+    current_task->iframe = iframe;
+    current_task->state = STATE_BLOCKED;
+    current_task->block_reason = BLOCK_QUEUE;
+    current_task->queue_next = *queue;
+    *queue = current_task;
+    schedule();
+}
+
+// Called with interrupts disabled
+void wake_all(task_t** queue) {
+    task_t* task = *queue;
+    *queue = NULL;
+    while (task) {
+        task_t* next = task->queue_next;
+        wake_task(task);
+        task = next;
+    }
 }
 
 int getpid() {
@@ -434,3 +955,101 @@ int getppid() {
     if (current_task == &init_task) return 0;
     return current_task->parent->pid;
 }
+
+int get_memory_stats(memory_stats_t* stats) {
+    stats->resident = current_task->mm.resident;
+    stats->limit = current_task->mm.limit;
+    address_space_usage(current_task->cr3, &stats->shared, &stats->page_tables);
+    return 0;
+}
+
+// Limit the resident pages of the current task, inherited by the tasks it forks or spawns.
+// Faults past the limit kill the task, brk() and mmap() fail up front when a request can't fit.
+// A limit can only be tightened, otherwise a limited task could simply lift it.
+int set_memory_limit(uint64_t pages) {
+    uint64_t limit = current_task->mm.limit;
+    if (pages == 0 || (limit != 0 && pages > limit)) return -1;
+    current_task->mm.limit = pages;
+    return 0;
+}
+
+// The calling task for pid 0 or its own pid, otherwise one of its children
+static task_t* find_own_task(int pid) {
+    if (pid == 0 || pid == current_task->pid) return current_task;
+    task_t* task = get_child(current_task, pid);
+    if (task == NULL || task->state == STATE_ZOMBIE) return NULL;
+    return task;
+}
+
+// Restrict the CPUs a task may run on, the calling task for pid 0 or one of its children.
+// Inherited by the tasks it forks or spawns. A task queued or running elsewhere moves the
+// next time it is scheduled, the calling task moves right away.
+int set_affinity(int pid, uint64_t mask, iframe_t* iframe) {
+    uint64_t online = 0;
+    for (int cpu = 0; cpu < cpu_count; cpu++) {
+        if (cpus[cpu].online) online |= 1ull << cpu;
+    }
+    task_t* task = find_own_task(pid);
+    if (task == NULL || (mask & online) == 0) return -1;
+    task->affinity = mask & online;
+    if (task != current_task || cpu_allowed(task, cpu_id())) return 0;
+
+    irq_save();
+    iframe->rax = 0;
+    current_task->iframe = iframe;
+    account_time();
+    current_task->state = STATE_READY;
+    send_running_away(&cpu_sched[cpu_id()], current_task);
+    schedule();
+}
+
+int64_t get_affinity(int pid) {
+    task_t* task = find_own_task(pid);
+    if (task == NULL) return -1;
+    return task->affinity;
+}
+
+// Includes the time since the CPU last accounted, which can be long for one that idles
+int get_cpu_stats(int cpu, cpu_stats_t* stats) {
+    if (cpu < 0 || cpu >= cpu_count) return -1;
+    uint64_t flags = irq_save();
+    if (cpu == cpu_id()) account_time();
+    *stats = cpu_sched[cpu].stats;
+    uint64_t pending = clock_ns() - cpu_sched[cpu].accounted;
+    if (cpu != cpu_id() && cpu_sched[cpu].accounted) {
+        if (cpus[cpu].task) {
+            stats->busy_ns += pending;
+        } else {
+            stats->idle_ns += pending;
+        }
+    }
+    irq_restore(flags);
+    return 0;
+}
+
+// Nice value from -20, the most CPU time, to 19, of the calling task for pid 0 or of one of
+// its children. Inherited by the tasks it forks or spawns.
+int setpriority(int pid, int nice) {
+    task_t* task = find_own_task(pid);
+    if (task == NULL) return -1;
+    if (nice < NICE_MIN) nice = NICE_MIN;
+    if (nice > NICE_MAX) nice = NICE_MAX;
+    uint32_t weight = nice_weights[nice - NICE_MIN];
+
+    uint64_t flags = irq_save();
+    if (task->state == STATE_READY && task != cpu_sched[task->cpu].outgoing) {
+        // Queued, keep the total weight of its CPU right
+        __atomic_add_fetch(&cpu_sched[task->cpu].run_weight, (uint64_t)weight - task->weight, __ATOMIC_RELAXED);
+    }
+    task->nice = nice;
+    task->weight = weight;
+    irq_restore(flags);
+    return 0;
+}
+
+// Returned as 20 - nice, from 1 to 40, so that it can't be mistaken for an error
+int getpriority(int pid) {
+    task_t* task = find_own_task(pid);
+    if (task == NULL) return -1;
+    return NICE_MAX + 1 - task->nice;
+}
@@ -3,6 +3,11 @@
 #include "../idt.h"
 #include "../mount.h"
 #include "fd.h"
+#include "../memory/vma.h"
+#include "../memory/fault.h"
+#include "../memory/paging.h"
+#include "../cpu.h"
+#include "../drivers/timer.h"
 
 typedef enum {
     STATE_READY,
@@ -12,7 +17,15 @@ typedef enum {
     STATE_DELETED
 } process_state_t;
 
-#define PROCESS_TICKS 10
+#define NICE_MIN -20
+#define NICE_MAX 19
+#define NICE_0_WEIGHT 1024
+#define SCHED_LATENCY_NS 20000000 // Period in which each ready task of a CPU runs once
+#define MIN_SLICE_NS 2000000
+#define AFFINITY_ALL UINT64_MAX
+
+#define USER_STACK_BASE 0x10000000000
+#define USER_STACK_SIZE (4096 * 128)
 
 #define WNOHANG 0x1
 
@@ -20,43 +33,85 @@ typedef enum {
     BLOCK_NONE,
     BLOCK_DELAY,
     BLOCK_WAITPID,
+    BLOCK_QUEUE,
 } block_reason_t;
 
+// Same layout as the user space struct in libc/mman.h, all counts in 4 KiB pages
+typedef struct {
+    uint64_t resident;
+    uint64_t shared;
+    uint64_t page_tables;
+    uint64_t limit;
+} memory_stats_t;
+
+// Same layout as the user space struct in libc/sched.h
+typedef struct {
+    uint64_t busy_ns;  // Time a task was running
+    uint64_t idle_ns;  // Time in the idle task
+    uint64_t switches; // Tasks switched to
+    uint64_t steals;   // Tasks taken from the queues of other CPUs
+    uint64_t halts;    // Times the idle task waited for work
+} cpu_stats_t;
+
 typedef struct Task {
     void* kernel_stack;
     iframe_t* iframe;
     int pid;
     process_state_t state;
     void* cr3;
+    uint16_t pcid; // PCID the address space was last loaded with
     void* initial_brk;
     void* brk;
-    void* fpu_state;
+    vma_t* vmas;
+    fault_stats_t faults;
+    mm_counters_t mm;
+    void* fpu_state; // NULL until the task first uses the FPU
     char wd[MAX_PATH];
     fd_entry_t fd_table[MAX_FDS];
     fd_entry_t* fd_ptr_table[MAX_FDS];
-    int64_t time_slice;
+    int nice;
+    uint32_t weight;   // Of the nice value
+    uint64_t vruntime; // Nanoseconds run, scaled by NICE_0_WEIGHT / weight
+    int cpu; // Last ran on, or queued on
+    uint64_t affinity; // Bit per CPU it may run on
     block_reason_t block_reason;
-    uint64_t blocked_ticks;
+    timer_t sleep_timer;
     int* wstatus;
     struct Task* blocked_process;
     int return_code;
-    struct Task* next;
+    struct Task* queue_next; // Ready queue or dead list
+    struct Task* heap_left; // Run queue skew heap
+    struct Task* heap_right;
     struct Task* next_sibling;
     struct Task* parent;
     struct Task* child;
 } task_t;
 
-extern task_t* current_task;
-extern int64_t ticks_remaining;
+#define current_task (this_cpu()->task)
+
+extern volatile uint8_t scheduler_initialized;
 
 void run_init(char* path);
 void run_next(iframe_t* iframe);
+void preempt_check(iframe_t* iframe);
+void __attribute__((noreturn)) enter_scheduler();
 void exit(int ret);
+void __attribute__((noreturn)) exit_from_fault(int ret);
 int fork(iframe_t* iframe);
+void handle_fpu_trap();
 int spawn(char* path, char** argv, iframe_t* iframe);
 int execv(char* path, char** argv, iframe_t* iframe);
 void sleep(uint64_t ms, iframe_t* iframe);
+void sleep_ns(uint64_t ns, iframe_t* iframe);
 int waitpid(int pid, int* wstatus, int options, iframe_t* iframe);
+void __attribute__((noreturn)) block_on(struct Task** queue, iframe_t* iframe);
+void wake_all(struct Task** queue);
 int getpid();
 int getppid();
-void check_blocked_tasks(int reduce_ticks);
+int get_memory_stats(memory_stats_t* stats);
+int set_memory_limit(uint64_t pages);
+int set_affinity(int pid, uint64_t mask, iframe_t* iframe);
+int64_t get_affinity(int pid);
+int get_cpu_stats(int cpu, cpu_stats_t* stats);
+int setpriority(int pid, int nice);
+int getpriority(int pid);
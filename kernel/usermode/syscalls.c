@@ -1,6 +1,7 @@
 #include "syscalls.h"
 #include "fd.h"
 #include "break.h"
+#include "mmap.h"
 #include "../drivers/block.h"
 #include "../mount.h"
 #include "../drivers/timer.h"
@@ -14,12 +15,98 @@
 #include "../drivers/serial.h"
 #include "../panic.h"
 #include "scheduler.h"
+#include "../drivers/tty.h"
+#include "../memory/fault.h"
 #include <stdarg.h>
 #include <stdint.h>
 
+static int user_string(uint64_t addr) {
+    return access_user_string(addr, MAX_PATH);
+}
+
+static int user_argv(uint64_t addr) {
+    for (char** argv = (char**)addr;; argv++) {
+        if (access_user_range((uintptr_t)argv, sizeof(char*), 0)) return -1;
+        if (*argv == NULL) return 0;
+        if (access_user_string((uintptr_t)*argv, USER_STACK_SIZE)) return -1; // Has to fit on the new stack
+    }
+}
+
+static int user_font(uint64_t addr) {
+    if (access_user_range(addr, sizeof(font_t), 0)) return -1;
+    font_t* font = (font_t*)addr;
+    size_t glyph_size = (font->width * font->height) / 8 + 1;
+    for (int i = 0; i < 128; i++) {
+        if (access_user_range((uintptr_t)font->ascii[i], glyph_size, 0)) return -1;
+    }
+    return 0;
+}
+
+// Check, and fault in, the user memory a syscall is going to use, so that the kernel never
+// faults on it. A fault the kernel takes on its own is a kernel bug and panics.
+static int check_user_args(uint64_t syscall_number, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5) {
+    switch (syscall_number) {
+    case SYSCALL_CREATE_FILE:
+    case SYSCALL_DELETE_FILE:
+    case SYSCALL_CREATE_DIR:
+    case SYSCALL_GET_FILE_SIZE:
+    case SYSCALL_CHDIR:
+    case SYSCALL_FILE_EXISTS:
+    case SYSCALL_IS_DIRECTORY:
+    case SYSCALL_UNMOUNT:
+    case SYSCALL_OPEN_FILE:
+        return user_string(arg1);
+    case SYSCALL_LIST_DIR:
+        return user_string(arg1) || access_user_range(arg2, 13, 1); // An 8.3 name
+    case SYSCALL_EXECV:
+    case SYSCALL_SPAWN:
+        return user_string(arg1) || user_argv(arg2);
+    case SYSCALL_GETCWD:
+        return access_user_range(arg1, arg2, 1);
+    case SYSCALL_SEND_UDP:
+        return access_user_range(arg1, 4, 0) || access_user_range(arg4, (int)arg5, 0);
+    case SYSCALL_PING:
+        return access_user_range(arg1, 4, 0);
+    case SYSCALL_GET_MAC:
+        return access_user_range(arg2, 6, 1);
+    case SYSCALL_GET_IP:
+        return access_user_range(arg2, sizeof(uint32_t), 1);
+    case SYSCALL_ADD_ROUTE:
+        return access_user_range(arg1, 4, 0) || access_user_range(arg2, 4, 0) || access_user_range(arg3, 4, 0);
+    case SYSCALL_REMOVE_ROUTE:
+        return access_user_range(arg1, 4, 0) || access_user_range(arg2, 4, 0);
+    case SYSCALL_MOUNT:
+        return user_string(arg1) || user_string(arg2);
+    case SYSCALL_READ:
+        return access_user_range(arg2, arg3, 1);
+    case SYSCALL_WRITE:
+        return access_user_range(arg2, arg3, 0);
+    case SYSCALL_WAITPID:
+        return arg2 && access_user_range(arg2, sizeof(int), 1);
+    case SYSCALL_TCGETATTR:
+        return access_user_range(arg2, sizeof(termios_t), 1);
+    case SYSCALL_TCSETATTR:
+        return access_user_range(arg2, sizeof(termios_t), 0);
+    case SYSCALL_SETFONT:
+        return user_font(arg1);
+    case SYSCALL_GET_FAULT_STATS:
+        return access_user_range(arg2, sizeof(fault_stats_t), 1);
+    case SYSCALL_GET_MEMORY_STATS:
+        return access_user_range(arg1, sizeof(memory_stats_t), 1);
+    case SYSCALL_GET_CPU_STATS:
+        return access_user_range(arg2, sizeof(cpu_stats_t), 1);
+    default:
+        return 0;
+    }
+}
+
 uint64_t syscall(uint64_t syscall_number, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5, uint64_t arg6, iframe_t* iframe) {
     asm volatile("sti");
     uint64_t ret = 0;
+    if (check_user_args(syscall_number, arg1, arg2, arg3, arg4, arg5)) {
+        iframe->rax = -1;
+        return -1;
+    }
     switch (syscall_number) {
     case SYSCALL_EXIT:
         exit((int)arg1);
@@ -46,7 +133,7 @@ uint64_t syscall(uint64_t syscall_number, uint64_t arg1, uint64_t arg2, uint64_t
         ret = fork(iframe);
         break;
     case SYSCALL_EXECV:
-        execv((char*)arg1, (char**)arg2, iframe);
+        ret = execv((char*)arg1, (char**)arg2, iframe);
         break;
     case SYSCALL_GET_TIME:
         // Not implemented, will come with RTC
@@ -141,7 +228,7 @@ uint64_t syscall(uint64_t syscall_number, uint64_t arg1, uint64_t arg2, uint64_t
         ret = close((int)arg1);
         break;
     case SYSCALL_READ:
-        ret = read((int)arg1, (void*)arg2, (size_t)arg3);
+        ret = read((int)arg1, (void*)arg2, (size_t)arg3, iframe);
         break;
     case SYSCALL_WRITE:
         ret = write((int)arg1, (const void*)arg2, (size_t)arg3);
@@ -182,6 +269,45 @@ uint64_t syscall(uint64_t syscall_number, uint64_t arg1, uint64_t arg2, uint64_t
     case SYSCALL_SETFONT:
         setfont((font_t*)arg1);
         break;
+    case SYSCALL_MMAP:
+        ret = (uintptr_t)mmap((void*)arg1, (size_t)arg2, (int)arg3, (int)arg4, (int)arg5, (size_t)arg6);
+        break;
+    case SYSCALL_MUNMAP:
+        ret = munmap((void*)arg1, (size_t)arg2);
+        break;
+    case SYSCALL_MPROTECT:
+        ret = mprotect((void*)arg1, (size_t)arg2, (int)arg3);
+        break;
+    case SYSCALL_GET_FAULT_STATS:
+        ret = get_fault_stats((int)arg1, (fault_stats_t*)arg2);
+        break;
+    case SYSCALL_GET_MEMORY_STATS:
+        ret = get_memory_stats((memory_stats_t*)arg1);
+        break;
+    case SYSCALL_SET_MEMORY_LIMIT:
+        ret = set_memory_limit(arg1);
+        break;
+    case SYSCALL_SET_AFFINITY:
+        ret = set_affinity((int)arg1, arg2, iframe);
+        break;
+    case SYSCALL_GET_AFFINITY:
+        ret = get_affinity((int)arg1);
+        break;
+    case SYSCALL_GET_CPU_STATS:
+        ret = get_cpu_stats((int)arg1, (cpu_stats_t*)arg2);
+        break;
+    case SYSCALL_SETPRIORITY:
+        ret = setpriority((int)arg1, (int)arg2);
+        break;
+    case SYSCALL_GETPRIORITY:
+        ret = getpriority((int)arg1);
+        break;
+    case SYSCALL_NANOSLEEP:
+        sleep_ns(arg1, iframe);
+        break;
+    case SYSCALL_GET_UPTIME_NS:
+        ret = clock_ns();
+        break;
     default:
         // Invalid syscall, return an error code
         ret = 0xFFFFFFFFFFFFFFFF;
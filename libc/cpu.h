@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(subleaf));
+}
+
+// AVX2 needs the CPU to implement it and the kernel to save the YMM registers
+static inline int cpu_supports_avx2() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 7) return 0;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (!(ecx & (1 << 27)) || !(ecx & (1 << 28))) return 0; // OSXSAVE and AVX
+
+    uint32_t xcr0_low, xcr0_high;
+    asm volatile("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+    if ((xcr0_low & 0x6) != 0x6) return 0; // XMM and YMM state enabled
+
+    cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+    return (ebx >> 5) & 1;
+}
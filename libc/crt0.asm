@@ -1,7 +1,9 @@
 section .text
 global _start
 extern main
+extern init_libc
 _start:
+    call init_libc
     pop rdi
     lea rsi, [rsp]
     ; Call the main function
@@ -0,0 +1,27 @@
+#include "mman.h"
+#include "syscall.h"
+#include <stdint.h>
+
+void* mmap(void* addr, size_t length, int prot, int flags, int fd, size_t offset) {
+    return (void*)syscall(SYSCALL_MMAP, (uint64_t)addr, length, prot, flags, fd, offset);
+}
+
+int munmap(void* addr, size_t length) {
+    return syscall(SYSCALL_MUNMAP, (uint64_t)addr, length, 0, 0, 0, 0);
+}
+
+int mprotect(void* addr, size_t length, int prot) {
+    return syscall(SYSCALL_MPROTECT, (uint64_t)addr, length, prot, 0, 0, 0);
+}
+
+int get_fault_stats(int scope, fault_stats_t* stats) {
+    return syscall(SYSCALL_GET_FAULT_STATS, scope, (uint64_t)stats, 0, 0, 0, 0);
+}
+
+int get_memory_stats(memory_stats_t* stats) {
+    return syscall(SYSCALL_GET_MEMORY_STATS, (uint64_t)stats, 0, 0, 0, 0, 0);
+}
+
+int set_memory_limit(uint64_t pages) {
+    return syscall(SYSCALL_SET_MEMORY_LIMIT, pages, 0, 0, 0, 0, 0);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROT_NONE 0x0
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC 0x4
+
+#define MAP_SHARED 0x01
+#define MAP_PRIVATE 0x02
+#define MAP_FIXED 0x10
+#define MAP_ANONYMOUS 0x20
+#define MAP_ANON MAP_ANONYMOUS
+
+#define MAP_FAILED ((void*)-1)
+
+#define FAULT_STATS_SELF 0
+#define FAULT_STATS_SYSTEM 1
+
+typedef struct {
+    uint64_t minor;      // Resolved without I/O
+    uint64_t major;      // Resolved by reading from disk
+    uint64_t zero_fills;
+    uint64_t file_pages;
+    uint64_t cow_copies;
+    uint64_t cow_reuses;
+    uint64_t guard_hits;
+    uint64_t invalid;    // Faults that killed the task, out of memory included
+    uint64_t zero_page_maps; // Reads of untouched memory served by the shared zero page
+    // Only filled in for FAULT_STATS_SYSTEM, the kernel's caches
+    uint64_t zero_pool_hits;      // Cleared frames taken from the pool filled while idle
+    uint64_t zero_pool_misses;
+    uint64_t file_cache_hits;     // File page lookups found in the page cache
+    uint64_t file_cache_misses;
+    uint64_t kernel_stack_hits;   // New tasks given a pooled kernel stack
+    uint64_t kernel_stack_misses;
+} fault_stats_t;
+
+// Memory use of the calling process, in 4 KiB pages
+typedef struct {
+    uint64_t resident;    // Pages mapped
+    uint64_t shared;      // Of those, pages whose frame is shared with another process or the page cache
+    uint64_t page_tables;
+    uint64_t limit;       // Most resident pages allowed, 0 for no limit
+} memory_stats_t;
+
+void* mmap(void* addr, size_t length, int prot, int flags, int fd, size_t offset);
+int munmap(void* addr, size_t length);
+int mprotect(void* addr, size_t length, int prot);
+
+int get_fault_stats(int scope, fault_stats_t* stats);
+int get_memory_stats(memory_stats_t* stats);
+int set_memory_limit(uint64_t pages); // Can only lower the limit
@@ -0,0 +1,24 @@
+#include "sched.h"
+#include "syscall.h"
+#include <stdint.h>
+
+int set_affinity(pid_t pid, uint64_t mask) {
+    return syscall(SYSCALL_SET_AFFINITY, pid, mask, 0, 0, 0, 0);
+}
+
+int64_t get_affinity(pid_t pid) {
+    return syscall(SYSCALL_GET_AFFINITY, pid, 0, 0, 0, 0, 0);
+}
+
+int get_cpu_stats(int cpu, cpu_stats_t* stats) {
+    return syscall(SYSCALL_GET_CPU_STATS, cpu, (uint64_t)stats, 0, 0, 0, 0);
+}
+
+int setpriority(pid_t pid, int nice) {
+    return syscall(SYSCALL_SETPRIORITY, pid, nice, 0, 0, 0, 0);
+}
+
+int getpriority(pid_t pid) {
+    int ret = syscall(SYSCALL_GETPRIORITY, pid, 0, 0, 0, 0, 0);
+    return ret < 0 ? ret : 20 - ret;
+}
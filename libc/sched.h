@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+#include "unistd.h"
+
+// Scheduler counters of one CPU
+typedef struct {
+    uint64_t busy_ns;  // Time a task was running
+    uint64_t idle_ns;  // Time in the idle task
+    uint64_t switches; // Tasks switched to
+    uint64_t steals;   // Tasks taken from the queues of other CPUs
+    uint64_t halts;    // Times the idle task waited for work
+} cpu_stats_t;
+
+// Bit per CPU a process may run on, pid 0 for the calling process or one of its children
+int set_affinity(pid_t pid, uint64_t mask);
+int64_t get_affinity(pid_t pid);
+int get_cpu_stats(int cpu, cpu_stats_t* stats); // -1 past the last CPU
+
+// Nice value from -20, the most CPU time, to 19, pid 0 for the calling process or one of its
+// children. getpriority() returns -1 for an unknown process, which is also a valid nice value.
+int setpriority(pid_t pid, int nice);
+int getpriority(pid_t pid);
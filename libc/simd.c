@@ -0,0 +1,212 @@
+#include "string.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Vector variants of the mem* functions, picked by init_string(). Blocks shorter than one
+// vector go to the next narrower variant, and instead of a byte tail the last vector is
+// moved at n - width, overlapping the one before it.
+//
+// The str* functions below only need SSE2 and are used directly.
+
+// Unaligned vectors, loads and stores through them compile to movdqu / vmovdqu
+typedef char v16 __attribute__((vector_size(16), may_alias, aligned(1)));
+typedef char v32 __attribute__((vector_size(32), may_alias, aligned(1)));
+
+// Operand types of the movemask builtins
+typedef char v16qi __attribute__((vector_size(16)));
+typedef char v32qi __attribute__((vector_size(32)));
+
+#define AVX2 __attribute__((target("avx2")))
+
+int memcmp_sse2(const void* ptr1, const void* ptr2, size_t n) {
+    const unsigned char* p1 = ptr1;
+    const unsigned char* p2 = ptr2;
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        int equal = __builtin_ia32_pmovmskb128((v16qi)(*(const v16*)(p1 + i) == *(const v16*)(p2 + i)));
+        if (equal != 0xFFFF) {
+            i += __builtin_ctz(~equal);
+            return p1[i] - p2[i];
+        }
+    }
+    return memcmp_scalar(p1 + i, p2 + i, n - i);
+}
+
+// Also safe for overlapping ranges with dest below src, which memmove relies on
+void* memcpy_sse2(void* dest, const void* src, size_t n) {
+    char* d = dest;
+    const char* s = src;
+    if (n < 16) return memcpy_scalar(dest, src, n);
+
+    v16 last = *(const v16*)(s + n - 16);
+    size_t i = 0;
+    for (; i + 64 < n; i += 64) {
+        *(v16*)(d + i) = *(const v16*)(s + i);
+        *(v16*)(d + i + 16) = *(const v16*)(s + i + 16);
+        *(v16*)(d + i + 32) = *(const v16*)(s + i + 32);
+        *(v16*)(d + i + 48) = *(const v16*)(s + i + 48);
+    }
+    for (; i + 16 < n; i += 16) {
+        *(v16*)(d + i) = *(const v16*)(s + i);
+    }
+    *(v16*)(d + n - 16) = last;
+    return dest;
+}
+
+void* memset_sse2(void* ptr, unsigned char value, size_t n) {
+    char* p = ptr;
+    if (n < 16) return memset_scalar(ptr, value, n);
+
+    v16 pattern = (v16){0} + (char)value;
+    for (size_t i = 0; i + 16 < n; i += 16) {
+        *(v16*)(p + i) = pattern;
+    }
+    *(v16*)(p + n - 16) = pattern;
+    return ptr;
+}
+
+void* memmove_sse2(void* dest, const void* src, size_t n) {
+    char* d = dest;
+    const char* s = src;
+    if (d <= s || d >= s + n) return memcpy_sse2(dest, src, n);
+    if (n < 16) return memmove_scalar(dest, src, n);
+
+    // Copy from the top down, the first vector is read before anything can overwrite it
+    v16 first = *(const v16*)s;
+    for (size_t i = n; i > 16; i -= 16) {
+        *(v16*)(d + i - 16) = *(const v16*)(s + i - 16);
+    }
+    *(v16*)d = first;
+    return dest;
+}
+
+// The AVX2 variants clear the upper YMM halves on the way out, so that the SSE code
+// after them does not pay for a state transition
+
+AVX2 int memcmp_avx2(const void* ptr1, const void* ptr2, size_t n) {
+    const unsigned char* p1 = ptr1;
+    const unsigned char* p2 = ptr2;
+    if (n < 32) return memcmp_sse2(ptr1, ptr2, n);
+
+    size_t i = 0;
+    int result = 0;
+    for (; i + 32 <= n; i += 32) {
+        uint32_t equal = __builtin_ia32_pmovmskb256((v32qi)(*(const v32*)(p1 + i) == *(const v32*)(p2 + i)));
+        if (equal != 0xFFFFFFFF) {
+            i += __builtin_ctz(~equal);
+            result = p1[i] - p2[i];
+            break;
+        }
+    }
+    __builtin_ia32_vzeroupper();
+    if (result == 0) return memcmp_sse2(p1 + i, p2 + i, n - i);
+    return result;
+}
+
+AVX2 void* memcpy_avx2(void* dest, const void* src, size_t n) {
+    char* d = dest;
+    const char* s = src;
+    if (n < 32) return memcpy_sse2(dest, src, n);
+
+    v32 last = *(const v32*)(s + n - 32);
+    size_t i = 0;
+    for (; i + 128 < n; i += 128) {
+        *(v32*)(d + i) = *(const v32*)(s + i);
+        *(v32*)(d + i + 32) = *(const v32*)(s + i + 32);
+        *(v32*)(d + i + 64) = *(const v32*)(s + i + 64);
+        *(v32*)(d + i + 96) = *(const v32*)(s + i + 96);
+    }
+    for (; i + 32 < n; i += 32) {
+        *(v32*)(d + i) = *(const v32*)(s + i);
+    }
+    *(v32*)(d + n - 32) = last;
+    __builtin_ia32_vzeroupper();
+    return dest;
+}
+
+AVX2 void* memset_avx2(void* ptr, unsigned char value, size_t n) {
+    char* p = ptr;
+    if (n < 32) return memset_sse2(ptr, value, n);
+
+    v32 pattern = (v32){0} + (char)value;
+    for (size_t i = 0; i + 32 < n; i += 32) {
+        *(v32*)(p + i) = pattern;
+    }
+    *(v32*)(p + n - 32) = pattern;
+    __builtin_ia32_vzeroupper();
+    return ptr;
+}
+
+AVX2 void* memmove_avx2(void* dest, const void* src, size_t n) {
+    char* d = dest;
+    const char* s = src;
+    if (d <= s || d >= s + n) return memcpy_avx2(dest, src, n);
+    if (n < 32) return memmove_sse2(dest, src, n);
+
+    v32 first = *(const v32*)s;
+    for (size_t i = n; i > 32; i -= 32) {
+        *(v32*)(d + i - 32) = *(const v32*)(s + i - 32);
+    }
+    *(v32*)d = first;
+    __builtin_ia32_vzeroupper();
+    return dest;
+}
+
+// Strings are scanned with aligned loads, which never cross into the next page, and the
+// bytes before the start of the string are masked out of the first block
+size_t strlen(const char* s) {
+    const char* block = (const char*)((uintptr_t)s & ~15ULL);
+    uint32_t zero = __builtin_ia32_pmovmskb128((v16qi)(*(const v16qi*)block == (v16qi){0}));
+    zero >>= s - block;
+    if (zero) return __builtin_ctz(zero);
+
+    for (;;) {
+        block += 16;
+        zero = __builtin_ia32_pmovmskb128((v16qi)(*(const v16qi*)block == (v16qi){0}));
+        if (zero) return block + __builtin_ctz(zero) - s;
+    }
+}
+
+char* strchr(const char* s, int c) {
+    v16qi wanted = (v16qi){0} + (char)c;
+    const char* block = (const char*)((uintptr_t)s & ~15ULL);
+    uint32_t offset = s - block;
+    for (;;) {
+        v16qi bytes = *(const v16qi*)block;
+        uint32_t hits = __builtin_ia32_pmovmskb128((v16qi)((bytes == wanted) | (bytes == (v16qi){0})));
+        hits = hits >> offset << offset;
+        if (hits) {
+            const char* found = block + __builtin_ctz(hits);
+            return *found == (char)c ? (char*)found : NULL;
+        }
+        block += 16;
+        offset = 0;
+    }
+}
+
+int strcmp(const char* s1, const char* s2) {
+    // Bytewise until s1 is aligned, then s1 is loaded aligned and s2 unaligned
+    for (; (uintptr_t)s1 & 15; s1++, s2++) {
+        if (*s1 != *s2 || *s1 == '\0') return (unsigned char)*s1 - (unsigned char)*s2;
+    }
+
+    for (;;) {
+        if (((uintptr_t)s2 & 4095) > 4096 - 16) {
+            // An unaligned load of s2 could touch the next page, which the string may not reach
+            for (int i = 0; i < 16; i++) {
+                if (s1[i] != s2[i] || s1[i] == '\0') return (unsigned char)s1[i] - (unsigned char)s2[i];
+            }
+        } else {
+            v16qi a = *(const v16qi*)s1;
+            v16qi b = (v16qi)*(const v16*)s2;
+            uint32_t same = __builtin_ia32_pmovmskb128((v16qi)((a == b) & ~(a == (v16qi){0})));
+            if (same != 0xFFFF) {
+                int i = __builtin_ctz(~same);
+                return (unsigned char)s1[i] - (unsigned char)s2[i];
+            }
+        }
+        s1 += 16;
+        s2 += 16;
+    }
+}
@@ -0,0 +1,6 @@
+#include "string.h"
+
+// Called by crt0 before main
+void init_libc() {
+    init_string();
+}
@@ -1,13 +1,7 @@
 #include "string.h"
+#include "cpu.h"
 #include <stddef.h>
-
-size_t strlen(const char *s) {
-    size_t len = 0;
-    while (s[len] != '\0') {
-        len++;
-    }
-    return len;
-}
+#include <stdint.h>
 
 char* strcpy(char *dest, const char *src) {
     char *ptr = dest;
@@ -61,14 +55,6 @@ char* strncat(char* dest, const char* src, size_t n) {
     return dest;
 }
 
-int strcmp(const char *s1, const char *s2) {
-    while (*s1 && *s2 && (*s1 == *s2)) {
-        s1++;
-        s2++;
-    }
-    return *(unsigned char *)s1 - *(unsigned char *)s2;
-}
-
 int strncmp(const char *s1, const char *s2, size_t n) {
     while (*s1 && *s2 && (*s1 == *s2) && n > 0) {
         s1++;
@@ -78,20 +64,6 @@ int strncmp(const char *s1, const char *s2, size_t n) {
     return *(unsigned char *)s1 - *(unsigned char *)s2;
 }
 
-char* strchr(const char *s, int c) {
-    while (*s) {
-        if (*s == c) {
-            return (char*)s;
-        }
-        s++;
-    }
-
-    if (c == '\0') {
-        return (char*)s;
-    }
-
-    return NULL;
-}
 char* strrchr(const char *s, int c) {
     char* last = NULL;
 
@@ -109,28 +81,126 @@ char* strrchr(const char *s, int c) {
     return last;
 }
 
-char* strstr(const char *haystack, const char *needle) {
-    if (*needle == '\0') return (char*)haystack; // empty needle
-
-    for (; *haystack != '\0'; haystack++) {
-        const char *h = haystack;
-        const char *n = needle;
-
-        // Compare the substring
-        while (*h && *n && *h == *n) {
-            h++;
-            n++;
+// Start of the maximal suffix of the needle under byte order, or reversed order, minus one
+// (so SIZE_MAX for the whole needle), and the period of that suffix
+static size_t maximal_suffix(const unsigned char* needle, size_t length, int reversed, size_t* period) {
+    size_t suffix = SIZE_MAX;
+    size_t j = 0;
+    size_t k = 1;
+    *period = 1;
+    while (j + k < length) {
+        unsigned char a = needle[j + k];
+        unsigned char b = needle[suffix + k];
+        if (reversed ? a > b : a < b) {
+            j += k;
+            k = 1;
+            *period = j - suffix;
+        } else if (a == b) {
+            if (k != *period) {
+                k++;
+            } else {
+                j += *period;
+                k = 1;
+            }
+        } else {
+            suffix = j++;
+            k = 1;
+            *period = 1;
         }
+    }
+    return suffix;
+}
 
-        if (*n == '\0') {
-            return (char*)haystack; // found full needle
+// Two-way string matching: linear in the haystack length with constant extra space.
+// The needle is split at a critical factorization, the right half is matched first
+// and a mismatch there shifts by how far it got, a match of both halves shifts by the
+// period, remembering the prefix already known to match when the needle is periodic.
+char* strstr(const char *haystack, const char *needle) {
+    if (needle[0] == '\0') return (char*)haystack; // empty needle
+    if (needle[1] == '\0') return strchr(haystack, needle[0]);
+
+    const unsigned char* h = (const unsigned char*)haystack;
+    const unsigned char* n = (const unsigned char*)needle;
+    size_t needle_length = strlen(needle);
+    size_t haystack_length = strlen(haystack);
+    if (haystack_length < needle_length) return NULL;
+
+    size_t period, reversed_period;
+    size_t split = maximal_suffix(n, needle_length, 0, &period) + 1;
+    size_t reversed_split = maximal_suffix(n, needle_length, 1, &reversed_period) + 1;
+    if (reversed_split > split) {
+        split = reversed_split;
+        period = reversed_period;
+    }
+
+    size_t last = haystack_length - needle_length;
+    if (memcmp(n, n + period, split) == 0) {
+        size_t memory = 0; // Needle prefix known to match at j
+        for (size_t j = 0; j <= last; ) {
+            size_t i = split > memory ? split : memory;
+            while (i < needle_length && n[i] == h[i + j]) i++;
+            if (i < needle_length) {
+                j += i - split + 1;
+                memory = 0;
+                continue;
+            }
+            i = split;
+            while (i > memory && n[i - 1] == h[i - 1 + j]) i--;
+            if (i <= memory) return (char*)h + j;
+            j += period;
+            memory = needle_length - period;
+        }
+    } else {
+        // No long overlap possible, shift past whichever half is longer
+        period = (split > needle_length - split ? split : needle_length - split) + 1;
+        for (size_t j = 0; j <= last; ) {
+            size_t i = split;
+            while (i < needle_length && n[i] == h[i + j]) i++;
+            if (i < needle_length) {
+                j += i - split + 1;
+                continue;
+            }
+            i = split;
+            while (i > 0 && n[i - 1] == h[i - 1 + j]) i--;
+            if (i == 0) return (char*)h + j;
+            j += period;
         }
     }
-
     return NULL; // not found
 }
 
-int memcmp(const void *ptr1, const void *ptr2, size_t n){
+// Implementations chosen by init_string(), SSE2 is part of the x86-64 baseline
+static int (*memcmp_impl)(const void*, const void*, size_t) = memcmp_sse2;
+static void* (*memcpy_impl)(void*, const void*, size_t) = memcpy_sse2;
+static void* (*memset_impl)(void*, unsigned char, size_t) = memset_sse2;
+static void* (*memmove_impl)(void*, const void*, size_t) = memmove_sse2;
+
+void init_string() {
+    if (cpu_supports_avx2()) {
+        memcmp_impl = memcmp_avx2;
+        memcpy_impl = memcpy_avx2;
+        memset_impl = memset_avx2;
+        memmove_impl = memmove_avx2;
+    }
+}
+
+int memcmp(const void *ptr1, const void *ptr2, size_t n) {
+    return memcmp_impl(ptr1, ptr2, n);
+}
+
+void* memcpy(void* dest, const void* src, size_t n) {
+    return memcpy_impl(dest, src, n);
+}
+
+void* memset(void* ptr, unsigned char value, size_t n) {
+    return memset_impl(ptr, value, n);
+}
+
+void* memmove(void* dest, const void* src, size_t n) {
+    return memmove_impl(dest, src, n);
+}
+
+int memcmp_scalar(const void *ptr1, const void *ptr2, size_t n){
     const unsigned char *p1 = (const unsigned char *)ptr1;
     const unsigned char *p2 = (const unsigned char *)ptr2;
 
@@ -142,7 +212,7 @@ int memcmp(const void *ptr1, const void *ptr2, size_t n){
     return 0; // Memory regions are equal
 }
 
-void* memcpy(void* dest, const void* src, size_t n) {
+void* memcpy_scalar(void* dest, const void* src, size_t n) {
     unsigned char *d = (unsigned char *)dest;
     const unsigned char *s = (const unsigned char *)src;
 
@@ -152,7 +222,7 @@ void* memcpy(void* dest, const void* src, size_t n) {
     return dest;
 }
 
-void* memset(void* ptr, unsigned char value, size_t n) {
+void* memset_scalar(void* ptr, unsigned char value, size_t n) {
     unsigned char *p = (unsigned char *)ptr;
 
     for (size_t i = 0; i < n; i++) {
@@ -161,13 +231,13 @@ void* memset(void* ptr, unsigned char value, size_t n) {
     return ptr;
 }
 
-void* memmove(void* dest, const void* src, size_t n) {
+void* memmove_scalar(void* dest, const void* src, size_t n) {
     unsigned char *d = (unsigned char *)dest;
     const unsigned char *s = (const unsigned char *)src;
 
     if (d < s || d >= s + n) {
         // Non-overlapping regions
-        return memcpy(dest, src, n);
+        return memcpy_scalar(dest, src, n);
     } else {
         // Overlapping regions
         for (size_t i = n; i > 0; i--) {
@@ -17,3 +17,19 @@ void*  memset(void *s, unsigned char c, size_t n);
 void*  memcpy(void *dest, const void *src, size_t n);
 void*  memmove(void *dest, const void *src, size_t n);
 int    memcmp(const void *s1, const void *s2, size_t n);
+
+// Called by crt0 before main, points the functions above at the fastest variants below
+void   init_string();
+
+int    memcmp_scalar(const void *s1, const void *s2, size_t n);
+void*  memcpy_scalar(void *dest, const void *src, size_t n);
+void*  memset_scalar(void *s, unsigned char c, size_t n);
+void*  memmove_scalar(void *dest, const void *src, size_t n);
+int    memcmp_sse2(const void *s1, const void *s2, size_t n);
+void*  memcpy_sse2(void *dest, const void *src, size_t n);
+void*  memset_sse2(void *s, unsigned char c, size_t n);
+void*  memmove_sse2(void *dest, const void *src, size_t n);
+int    memcmp_avx2(const void *s1, const void *s2, size_t n); // Only when cpu_supports_avx2()
+void*  memcpy_avx2(void *dest, const void *src, size_t n);
+void*  memset_avx2(void *s, unsigned char c, size_t n);
+void*  memmove_avx2(void *dest, const void *src, size_t n);
@@ -57,5 +57,18 @@
 #define SYSCALL_TCSETATTR 58
 #define SYSCALL_DRIVE_LOAD_EJECT 59
 #define SYSCALL_SETFONT 60
+#define SYSCALL_MMAP 61
+#define SYSCALL_MUNMAP 62
+#define SYSCALL_MPROTECT 63
+#define SYSCALL_GET_FAULT_STATS 64
+#define SYSCALL_GET_MEMORY_STATS 65
+#define SYSCALL_SET_MEMORY_LIMIT 66
+#define SYSCALL_SET_AFFINITY 67
+#define SYSCALL_GET_AFFINITY 68
+#define SYSCALL_GET_CPU_STATS 69
+#define SYSCALL_SETPRIORITY 70
+#define SYSCALL_GETPRIORITY 71
+#define SYSCALL_NANOSLEEP 72
+#define SYSCALL_GET_UPTIME_NS 73
 
 uint64_t syscall(uint64_t syscall_number, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5, uint64_t arg6);
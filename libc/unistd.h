@@ -24,5 +24,8 @@ pid_t wait(int *wstatus);
 
 void yield();
 void sleep(uint64_t ms);
+void usleep(uint64_t us);
+uint64_t get_uptime(); // Milliseconds since boot
+uint64_t get_uptime_ns();
 
 int isatty(int fd);
@@ -8,3 +8,15 @@ void yield() {
 void sleep(uint64_t ms) {
     syscall(SYSCALL_SLEEP, ms, 0, 0, 0, 0, 0);
 }
+
+void usleep(uint64_t us) {
+    syscall(SYSCALL_NANOSLEEP, us * 1000, 0, 0, 0, 0, 0);
+}
+
+uint64_t get_uptime() {
+    return syscall(SYSCALL_GET_UPTIME, 0, 0, 0, 0, 0, 0);
+}
+
+uint64_t get_uptime_ns() {
+    return syscall(SYSCALL_GET_UPTIME_NS, 0, 0, 0, 0, 0, 0);
+}